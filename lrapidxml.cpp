@@ -1,12 +1,37 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <climits>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <rapidxml.hpp>
 #include <rapidxml_utils.hpp>
 #include <rapidxml_print.hpp>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+#endif
+
 #include "lrapidxml.hpp"
 
 #define NAME_KEY    "name"
@@ -17,18 +42,390 @@
 #define MAX_MSG_LEN 256
 #define MARK_ERROR(x,note,what) snprintf( x,MAX_MSG_LEN,"%s:%s",note,what )
 
-int decode_node( lua_State *L,rapidxml::xml_node<> *node,char *msg );
-int encode_node( lua_State *L,int index,
-    rapidxml::xml_document<> *doc,rapidxml::xml_node<> *node,char *msg );
+#if LUA_VERSION_NUM < 502 /* lua 5.1 */
+    #define lua_rawlen lua_objlen
+#endif
+
+/* values at least threshold bytes long are pushed as slices of the source */
+struct slice_source
+{
+    size_t threshold;
+    int index;                                  /* source string,0 if owner */
+    std::shared_ptr< std::vector<char> > owner; /* source read from a file */
+};
+
+int decode_node( lua_State *L,
+    rapidxml::xml_node<> *node,char *msg,const slice_source *slice = NULL );
+int encode_node( lua_State *L,int index,rapidxml::xml_document<> *doc,
+    rapidxml::xml_node<> *node,int ignore_extra,char *msg );
+int buffer_view( lua_State *L,int index,const char **ptr,size_t *size );
+int slice_view( lua_State *L,int index,const char **ptr,size_t *size );
+void slice_push( lua_State *L,const char *ptr,size_t size,const slice_source *slice );
+size_t slice_option( lua_State *L,int index );
+int decode_slices( lua_State *L,int from_file );
+int cache_option( lua_State *L,int index,int def,int *lazy );
+int decode_cached( lua_State *L,int from_file,int lazy );
+int compact_option( lua_State *L,int index );
+int decode_compact( lua_State *L,int from_file );
+int decode_into( lua_State *L );
 
 void lua_rapidxml_error( lua_State *L,const char *msg )
 {
     luaL_error( L,msg );
 }
 
-int decode_element( lua_State *L,rapidxml::xml_node<> *node,char *msg )
+/* message of a lua error at index,the type name if it's not a string */
+const char *lua_rapidxml_errmsg( lua_State *L,int index )
+{
+    const char *what = lua_tostring( L,index );
+    return what ? what : luaL_typename( L,index );
+}
+
+/* userdata at index 1 for __gc,NULL if it's finalized already.a finalized
+ * userdata has no metatable,so a second __gc do nothing and every method
+ * reject it in luaL_checkudata
+ */
+void *lua_rapidxml_gc_udata( lua_State *L,const char *name )
+{
+    if ( LUA_TUSERDATA == lua_type( L,1 ) )
+    {
+        if ( !lua_getmetatable( L,1 ) ) return NULL;
+        lua_pop( L,1 );
+    }
+
+    return luaL_checkudata( L,1,name );
+}
+
+void lua_rapidxml_gc_done( lua_State *L )
+{
+    lua_pushnil( L );
+    lua_setmetatable( L,1 );
+}
+
+/* ============================ xml scanner ================================= */
+/* a light tokenizer which only find out where the tags are.it never allocate
+ * any node and never rely on a '\0' terminator,so it can skip a large subtree
+ * much faster than a full parse.the character classes are rapidxml's own
+ * lookup tables,so what it accept is what rapidxml accept.
+ */
+#define XS_WS(c)        \
+    rapidxml::internal::lookup_tables<0>::lookup_whitespace[(unsigned char)(c)]
+#define XS_NAME(c)      \
+    rapidxml::internal::lookup_tables<0>::lookup_node_name[(unsigned char)(c)]
+#define XS_ATTR_NAME(c) \
+    rapidxml::internal::lookup_tables<0>::lookup_attribute_name[(unsigned char)(c)]
+
+enum
+{
+    XS_EOF   = 0, /* no more token */
+    XS_START = 1, /* <name ...> */
+    XS_EMPTY = 2, /* <name .../> */
+    XS_END   = 3, /* </name> */
+    XS_TEXT  = 4, /* character data */
+    XS_CDATA = 5, /* <![CDATA[...]]> */
+    XS_MISC  = 6, /* <?...?> <!--...--> <!DOCTYPE ...>,rapidxml skip these */
+    XS_MORE  = 7, /* token not complete,need more data */
+    XS_ERROR = 8
+};
+
+struct xml_scanner
+{
+    const char *cur;
+    const char *end;
+    int depth;
+};
+
+struct xml_token
+{
+    int type;
+    const char *begin; /* the whole token is [begin,end) */
+    const char *end;
+    const char *name;  /* tag name,or value of text and cdata */
+    size_t name_len;
+    const char *attr;  /* attribute area of a start tag,[attr,attr_end) */
+    const char *attr_end;
+    int blank;         /* text contain white space only */
+    const char *what;  /* error message,error position is end */
+};
+
+void scan_init( xml_scanner *s,const char *begin,const char *end )
+{
+    /* utf-8 bom */
+    if ( end - begin >= 3 && (unsigned char)begin[0] == 0xEF
+        && (unsigned char)begin[1] == 0xBB && (unsigned char)begin[2] == 0xBF )
+    {
+        begin += 3;
+    }
+
+    s->cur   = begin;
+    s->end   = end;
+    s->depth = 0;
+}
+
+/* find pattern in [p,end),return the position of pattern or NULL */
+const char *scan_find( const char *p,const char *end,const char *pat,size_t len )
+{
+    while ( end - p >= (ptrdiff_t)len )
+    {
+        p = (const char *)memchr( p,pat[0],end - p - len + 1 );
+        if ( !p ) return NULL;
+        if ( 0 == memcmp( p,pat,len ) ) return p;
+
+        ++p;
+    }
+
+    return NULL;
+}
+
+/* stop at end of data.if eof is not set,the token may be completed by more
+ * data,so report XS_MORE and keep the position unchanged
+ */
+int scan_incomplete( xml_scanner *s,xml_token *tk,int eof )
+{
+    if ( !eof ) return tk->type = XS_MORE;
+
+    tk->what = "unexpected end of data";
+    tk->end  = s->end;
+    return tk->type = XS_ERROR;
+}
+
+int scan_error( xml_token *tk,const char *where,const char *what )
+{
+    tk->what = what;
+    tk->end  = where;
+    return tk->type = XS_ERROR;
+}
+
+int scan_tag( xml_scanner *s,xml_token *tk,int eof )
+{
+    const char *end = s->end;
+    const char *p   = tk->begin + 1;
+
+    tk->name = p;
+    while ( p < end && XS_NAME(*p) ) ++p;
+    if ( p >= end ) return scan_incomplete( s,tk,eof );
+    if ( p == tk->name ) return scan_error( tk,p,"expected element name" );
+    tk->name_len = p - tk->name;
+
+    while ( p < end && XS_WS(*p) ) ++p;
+
+    tk->attr = p;
+    while ( p < end && XS_ATTR_NAME(*p) )
+    {
+        while ( p < end && XS_ATTR_NAME(*p) ) ++p;
+        while ( p < end && XS_WS(*p) ) ++p;
+        if ( p >= end ) return scan_incomplete( s,tk,eof );
+        if ( '=' != *p ) return scan_error( tk,p,"expected =" );
+        ++p;
+
+        while ( p < end && XS_WS(*p) ) ++p;
+        if ( p >= end ) return scan_incomplete( s,tk,eof );
+        if ( '\'' != *p && '"' != *p ) return scan_error( tk,p,"expected ' or \"" );
+
+        p = (const char *)memchr( p + 1,*p,end - p - 1 );
+        if ( !p ) return scan_incomplete( s,tk,eof );
+        ++p;
+
+        while ( p < end && XS_WS(*p) ) ++p;
+    }
+    tk->attr_end = p;
+
+    if ( p >= end ) return scan_incomplete( s,tk,eof );
+    if ( '>' == *p )
+    {
+        tk->type = XS_START;
+        ++s->depth;
+    }
+    else if ( '/' == *p )
+    {
+        if ( p + 1 >= end ) return scan_incomplete( s,tk,eof );
+        if ( '>' != *(++p) ) return scan_error( tk,p,"expected >" );
+        tk->type = XS_EMPTY;
+    }
+    else
+    {
+        return scan_error( tk,p,"expected >" );
+    }
+
+    tk->end = s->cur = p + 1;
+    return tk->type;
+}
+
+int scan_close_tag( xml_scanner *s,xml_token *tk,int eof )
+{
+    const char *end = s->end;
+    const char *p   = tk->begin + 2;
+
+    tk->name = p;
+    while ( p < end && XS_NAME(*p) ) ++p;
+    tk->name_len = p - tk->name;
+
+    while ( p < end && XS_WS(*p) ) ++p;
+    if ( p >= end ) return scan_incomplete( s,tk,eof );
+    if ( '>' != *p ) return scan_error( tk,p,"expected >" );
+    if ( s->depth <= 0 ) return scan_error( tk,tk->begin,"unexpected closing tag" );
+
+    --s->depth;
+    tk->end = s->cur = p + 1;
+    return tk->type = XS_END;
+}
+
+/* <!DOCTYPE ...[...]> may contain '>' inside the brackets */
+int scan_doctype( xml_scanner *s,xml_token *tk,int eof )
+{
+    const char *end = s->end;
+    const char *p   = tk->begin + 10;
+
+    int bracket = 0;
+    for ( ;p < end; ++p )
+    {
+        if ( '[' == *p ) ++bracket;
+        else if ( ']' == *p && bracket > 0 ) --bracket;
+        else if ( '>' == *p && 0 == bracket ) break;
+    }
+    if ( p >= end ) return scan_incomplete( s,tk,eof );
+
+    tk->end = s->cur = p + 1;
+    return tk->type = XS_MISC;
+}
+
+/* scan a token between [begin,end),only XS_MISC,XS_CDATA need this */
+int scan_until( xml_scanner *s,xml_token *tk,int eof,
+    int type,size_t skip,const char *pat,size_t len )
+{
+    const char *p = scan_find( tk->begin + skip,s->end,pat,len );
+    if ( !p ) return scan_incomplete( s,tk,eof );
+
+    tk->name     = tk->begin + skip;
+    tk->name_len = p - tk->name;
+    tk->end = s->cur = p + len;
+    return tk->type = type;
+}
+
+int scan_token( xml_scanner *s,xml_token *tk,int eof )
+{
+    const char *p   = s->cur;
+    const char *end = s->end;
+
+    tk->begin = p;
+    tk->what  = NULL;
+    if ( p >= end ) return eof ? (tk->type = XS_EOF) : (tk->type = XS_MORE);
+
+    if ( '<' != *p )
+    {
+        const char *lt = (const char *)memchr( p,'<',end - p );
+        if ( !lt )
+        {
+            if ( !eof ) return tk->type = XS_MORE;
+            lt = end;
+        }
+
+        tk->blank = 1;
+        for ( const char *c = p;c < lt; ++c )
+        {
+            if ( !XS_WS(*c) ) { tk->blank = 0; break; }
+        }
+        tk->name     = p;
+        tk->name_len = lt - p;
+        tk->end = s->cur = lt;
+        return tk->type = XS_TEXT;
+    }
+
+    if ( end - p < 2 ) return scan_incomplete( s,tk,eof );
+    switch ( p[1] )
+    {
+    case '/' : return scan_close_tag( s,tk,eof );
+    case '?' : return scan_until( s,tk,eof,XS_MISC,2,"?>",2 );
+    case '!' :
+    {
+        /* need 10 bytes to tell "<!DOCTYPE " from others */
+        if ( end - p < 10 && !eof ) return tk->type = XS_MORE;
+
+        size_t left = end - p;
+        if ( left >= 4 && 0 == memcmp( p,"<!--",4 ) )
+        {
+            return scan_until( s,tk,eof,XS_MISC,4,"-->",3 );
+        }
+        if ( left >= 9 && 0 == memcmp( p,"<![CDATA[",9 ) )
+        {
+            return scan_until( s,tk,eof,XS_CDATA,9,"]]>",3 );
+        }
+        if ( left >= 10 && 0 == memcmp( p,"<!DOCTYPE",9 ) && XS_WS(p[9]) )
+        {
+            return scan_doctype( s,tk,eof );
+        }
+
+        return scan_until( s,tk,eof,XS_MISC,2,">",1 );
+    }
+    default : return scan_tag( s,tk,eof );
+    }
+
+    return tk->type = XS_ERROR;
+}
+
+/* skip current element's subtree,the start tag had been scanned */
+int scan_skip_element( xml_scanner *s,xml_token *tk,int eof )
+{
+    int depth = s->depth - 1;
+    do
+    {
+        int type = scan_token( s,tk,eof );
+        if ( XS_END == type && depth == s->depth ) return type;
+        if ( XS_EOF == type ) return scan_incomplete( s,tk,eof );
+        if ( XS_MORE == type || XS_ERROR == type ) return type;
+    } while ( true );
+
+    return XS_ERROR;
+}
+
+/* iterate attributes in [*pos,end),the area had been checked by scan_tag */
+int scan_attribute( const char **pos,const char *end,
+    const char **name,size_t *name_len,const char **value,size_t *value_len )
+{
+    const char *p = *pos;
+    if ( p >= end || !XS_ATTR_NAME(*p) ) return 0;
+
+    *name = p;
+    while ( XS_ATTR_NAME(*p) ) ++p;
+    *name_len = p - *name;
+
+    while ( XS_WS(*p) ) ++p;
+    ++p; /* skip = */
+    while ( XS_WS(*p) ) ++p;
+
+    char quote = *p++;
+    *value = p;
+    p = (const char *)memchr( p,quote,end - p );
+    *value_len = p - *value;
+
+    ++p;
+    while ( p < end && XS_WS(*p) ) ++p;
+
+    *pos = p;
+    return 1;
+}
+
+/* position of a error in a scan buffer,for error message */
+#define MARK_SCAN_ERROR(x,note,tk,base) \
+    snprintf( x,MAX_MSG_LEN,"%s:%s at offset %ld",note,(tk).what,(long)((tk).end - (base)) )
+
+/* push a text value,as a slice if it's large enough */
+void decode_push_text( lua_State *L,
+    const char *str,size_t len,const slice_source *slice )
+{
+    if ( slice && len >= slice->threshold )
+    {
+        slice_push( L,str,len,slice );
+        return;
+    }
+
+    lua_pushlstring( L,str,len );
+}
+
+int decode_element( lua_State *L,
+    rapidxml::xml_node<> *node,char *msg,const slice_source *slice = NULL )
 {
-    if ( rapidxml::node_element != node->type() )
+    if ( !node || rapidxml::node_element != node->type() )
     {
         MARK_ERROR( msg,"decode element","not a xml element" );
         return -1;
@@ -57,7 +454,7 @@ int decode_element( lua_State *L,rapidxml::xml_node<> *node,char *msg )
         if ( sub_node->next_sibling() 
             || rapidxml::node_element == sub_node->type() )
         {
-            if ( decode_node( L,sub_node,msg ) < 0 )
+            if ( decode_node( L,sub_node,msg,slice ) < 0 )
             {
                 lua_settop( L,top );
                 return -1;
@@ -68,7 +465,7 @@ int decode_element( lua_State *L,rapidxml::xml_node<> *node,char *msg )
             /* if value only contain one value,decode as string,not a table */
             assert( rapidxml::node_data == sub_node->type() ||
                 rapidxml::node_cdata == sub_node->type() );
-            lua_pushlstring( L,sub_node->value(),sub_node->value_size() );
+            decode_push_text( L,sub_node->value(),sub_node->value_size(),slice );
         }
         lua_rawset( L,-3 );
     }
@@ -92,7 +489,8 @@ int decode_element( lua_State *L,rapidxml::xml_node<> *node,char *msg )
     return 0;
 }
 
-int decode_node( lua_State *L,rapidxml::xml_node<> *node,char *msg )
+int decode_node( lua_State *L,
+    rapidxml::xml_node<> *node,char *msg,const slice_source *slice )
 {
     int top = lua_gettop( L );
     if ( top > MAX_STACK )
@@ -115,7 +513,7 @@ int decode_node( lua_State *L,rapidxml::xml_node<> *node,char *msg )
         {
             case rapidxml::node_element :
             {
-                if ( decode_element( L,child,msg ) < 0 )
+                if ( decode_element( L,child,msg,slice ) < 0 )
                 {
                     lua_settop( L,top );
                     return -1;
@@ -123,7 +521,7 @@ int decode_node( lua_State *L,rapidxml::xml_node<> *node,char *msg )
             }break;
             case rapidxml::node_data:  /* auto fall through */
             case rapidxml::node_cdata:
-                lua_pushlstring( L,child->value(),child->value_size() );
+                decode_push_text( L,child->value(),child->value_size(),slice );
                 break;
             default:
                 MARK_ERROR( msg,"xml decode","unsupport xml type" );
@@ -136,71 +534,253 @@ int decode_node( lua_State *L,rapidxml::xml_node<> *node,char *msg )
     return 1;
 }
 
-int decode( lua_State *L )
+/* ============================ token decoder =============================== */
+/* build the tables straight from scanner tokens,no rapidxml node at all.the
+ * result is the same as decode_element.the input is bounded by length,so a
+ * slice of a larger buffer can be decoded without copy.
+ * every open element keep it's table and value table on lua stack,the state
+ * is not on C stack,so it can stop and continue later
+ */
+struct token_decoder
 {
-    const char *str = luaL_checkstring( L,1 );
+    xml_scanner s;
+    const char *base;       /* for error offset */
+    int done;               /* root element closed */
+    std::vector<int> count; /* value count of every open element */
+};
 
-    int return_code = 0;
-    char msg[MAX_MSG_LEN] = { 0 };
+void token_decoder_init( token_decoder *td,const char *str,size_t len )
+{
+    scan_init( &td->s,str,str + len );
+    td->base = str;
+    td->done = 0;
+    td->count.clear();
+}
+
+/* push a element table with name and attribute */
+void token_push_element( lua_State *L,xml_token *tk )
+{
+    lua_newtable( L );
+
+    lua_pushstring( L,NAME_KEY );
+    lua_pushlstring( L,tk->name,tk->name_len );
+    lua_rawset( L,-3 );
 
+    const char *name  = NULL;
+    const char *value = NULL;
+    size_t name_len   = 0;
+    size_t value_len  = 0;
+    const char *pos   = tk->attr;
+    if ( !scan_attribute( &pos,tk->attr_end,&name,&name_len,&value,&value_len ) )
     {
-        rapidxml::xml_document<> doc;
-        try
-        {
-            /* nerver modify str */
-            doc.parse<rapidxml::parse_non_destructive>( const_cast<char *>(str) );
-            return_code = decode_element( L,doc.first_node(),msg );
-        }
-        catch ( const std::runtime_error& e )
+        return;
+    }
+
+    lua_pushstring( L,ATTR_KEY );
+    lua_newtable( L );
+    do
+    {
+        lua_pushlstring( L,name,name_len );
+        lua_pushlstring( L,value,value_len );
+        lua_rawset( L,-3 );
+    } while ( scan_attribute( &pos,tk->attr_end,&name,&name_len,&value,&value_len ) );
+    lua_rawset( L,-3 );
+}
+
+/* the value(string or element) on top is complete,append it to it's parent */
+void token_append( lua_State *L,token_decoder *td )
+{
+    if ( td->count.empty() )
+    {
+        td->done = 1; /* root element,leave it on stack */
+        return;
+    }
+
+    lua_rawseti( L,-2,++td->count.back() );
+}
+
+/* element table and value table on top,close them like decode_element */
+void token_close_element( lua_State *L,token_decoder *td )
+{
+    int count = td->count.back();
+    td->count.pop_back();
+
+    if ( 0 == count ) /* has no value */
+    {
+        lua_pop( L,1 );
+    }
+    else
+    {
+        /* if value only contain one value,decode as string,not a table */
+        lua_rawgeti( L,-1,1 );
+        if ( 1 == count && LUA_TSTRING == lua_type( L,-1 ) )
         {
-            return_code = -1;
-            MARK_ERROR( msg,"xml decode fail",e.what() );
+            lua_remove( L,-2 );
         }
-        catch (const rapidxml::parse_error& e)
+        else
         {
-            return_code = -1;
-            MARK_ERROR( msg,"invalid xml string",e.what() );
+            lua_pop( L,1 );
         }
-        catch (const std::exception& e)
+
+        lua_pushstring( L,VALUE_KEY );
+        lua_insert( L,-2 );
+        lua_rawset( L,-3 );
+    }
+
+    token_append( L,td );
+}
+
+/* decode at most budget tokens(unlimited if less than 0),root element table
+ * left on stack when finish.return 1 if finish,0 if not yet,-1 if error
+ */
+int token_decode( lua_State *L,token_decoder *td,int budget,char *msg )
+{
+    xml_token tk;
+    for ( int n = 0;budget < 0 || n < budget; ++n )
+    {
+        switch ( scan_token( &td->s,&tk,1 ) )
         {
-            return_code = -1;
-            MARK_ERROR( msg,"xml decode fail",e.what() );
+        case XS_EOF :
+            if ( 0 != td->s.depth )
+            {
+                scan_incomplete( &td->s,&tk,1 );
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,td->base );
+                return -1;
+            }
+            if ( !td->done )
+            {
+                MARK_ERROR( msg,"decode element","not a xml element" );
+                return -1;
+            }
+            return 1;
+        case XS_ERROR :
+            MARK_SCAN_ERROR( msg,"invalid xml string",tk,td->base );
+            return -1;
+        case XS_MISC : break;
+        case XS_TEXT :
+            if ( tk.blank ) break;
+            if ( 0 == td->s.depth )
+            {
+                scan_error( &tk,tk.begin,"expected <" );
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,td->base );
+                return -1;
+            }
+            if ( td->done ) break;
+
+            lua_pushlstring( L,tk.name,tk.name_len );
+            token_append( L,td );
+            break;
+        case XS_CDATA :
+            if ( td->done ) break;
+            if ( 0 == td->s.depth )
+            {
+                MARK_ERROR( msg,"decode element","not a xml element" );
+                return -1;
+            }
+
+            lua_pushlstring( L,tk.name,tk.name_len );
+            token_append( L,td );
+            break;
+        case XS_START :
+        case XS_EMPTY :
+            /* other root elements are checked but not decoded,like rapidxml */
+            if ( td->done ) break;
+            if ( lua_gettop( L ) > MAX_STACK )
+            {
+                MARK_ERROR( msg,"xml decode","stack overflow" );
+                return -1;
+            }
+            if ( !lua_checkstack( L,5 ) )
+            {
+                MARK_ERROR( msg,"decode element","xml decode out of stack" );
+                return -1;
+            }
+
+            token_push_element( L,&tk );
+            if ( XS_START == tk.type )
+            {
+                lua_newtable( L );
+                td->count.push_back( 0 );
+            }
+            else
+            {
+                token_append( L,td );
+            }
+            break;
+        case XS_END :
+            if ( !td->done ) token_close_element( L,td );
+            break;
         }
-        catch (...)
+    }
+
+    return 0;
+}
+
+/* decode( buffer,offset,length ),buffer is a string,userdata,lightuserdata,
+ * buffer or slice and offset start from 0.it's parsed by rapidxml like
+ * decode( str ),in place if a '\0' follow the view,else from a copy.a
+ * lightuserdata has no size,the caller's length is trusted
+ */
+int decode_buffer( lua_State *L )
+{
+    const char *ptr = NULL;
+    size_t size = 0;
+    int terminated = 0; /* ptr[size] is a readable '\0' */
+    switch ( lua_type( L,1 ) )
+    {
+    case LUA_TSTRING :
+        ptr = lua_tolstring( L,1,&size );
+        terminated = 1;
+        break;
+    case LUA_TUSERDATA :
+        if ( buffer_view( L,1,&ptr,&size ) )
         {
-            return_code = -1;
-            MARK_ERROR( msg,"xml decode fail","unknow error" );
+            terminated = 1;
+            break;
         }
 
-        /* rapidxml static memory pool will never free,until you call clear */
-        doc.clear();
+        ptr  = (const char *)lua_touserdata( L,1 );
+        size = lua_rawlen( L,1 );
+        break;
+    case LUA_TLIGHTUSERDATA :
+        ptr  = (const char *)lua_touserdata( L,1 );
+        size = (size_t)-1;
+        break;
+    default :
+        return luaL_error( L,"argument #1 string or userdata expect" );
     }
 
-    if ( return_code < 0 )
+    lua_Integer offset = luaL_checkinteger( L,2 );
+    lua_Integer length = luaL_checkinteger( L,3 );
+    if ( !ptr || offset < 0 || length < 0 || (size_t)offset > size
+        || (size_t)length > size - (size_t)offset )
     {
-        lua_rapidxml_error( L,msg );
-        return 0;
+        return luaL_error( L,"buffer view out of range" );
     }
 
-    return 1;
-}
-
-int decode_from_file( lua_State *L )
-{
-    const char *path = luaL_checkstring( L,1 );
+    const char *text = ptr + offset;
+    size_t end = (size_t)offset + (size_t)length;
+    int in_place = LUA_TLIGHTUSERDATA != lua_type( L,1 )
+        && ( end < size || terminated ) && '\0' == text[length];
 
     int return_code = 0;
     char msg[MAX_MSG_LEN] = { 0 };
-    /* luaL_error do a longjump,conflict with C++ stack unwind
-     * so we make a code block here
-     */
+
     {
         rapidxml::xml_document<> doc;
+        std::vector<char> copy;
         try
         {
-            rapidxml::file<> in( path );
+            if ( !in_place )
+            {
+                copy.reserve( (size_t)length + 1 );
+                copy.assign( text,text + length );
+                copy.push_back( '\0' );
+                text = &copy[0];
+            }
+
             /* nerver modify str */
-            doc.parse<rapidxml::parse_non_destructive>( const_cast<char *>(in.data()) );
+            doc.parse<rapidxml::parse_non_destructive>( const_cast<char *>(text) );
             return_code = decode_element( L,doc.first_node(),msg );
         }
         catch ( const std::runtime_error& e )
@@ -237,262 +817,6626 @@ int decode_from_file( lua_State *L )
     return 1;
 }
 
-rapidxml::xml_node<> *encode_element( 
-    lua_State *L,int index,rapidxml::xml_document<> *doc,char *msg )
+/* ============================ time-sliced decode ========================== */
+/* decode( str,{ yield_nodes = 4096,yield_time = 2000 } )
+ * run the token decoder for a budget of tokens or microseconds,then yield to
+ * the calling coroutine and continue when it's resumed.the state is kept in a
+ * userdata and the open tables stay on lua stack,they both survive a yield.
+ * outside a coroutine(or in lua 5.1) the budget is ignored.
+ */
+#define DECODE_STATE_MT "lua_rapidxml.decode_state"
+#define DECODE_STEP     256  /* tokens between two clock check */
+
+struct decode_state
 {
-    if ( !lua_istable( L,index ) )
+    token_decoder td;
+    int nodes;  /* token budget of one slice,0 means no limit */
+    int usec;   /* time budget of one slice,0 means no limit */
+    int top;    /* lua stack top after last slice */
+};
+
+int decode_state_gc( lua_State *L )
+{
+    decode_state *ds = (decode_state *)lua_rapidxml_gc_udata( L,DECODE_STATE_MT );
+    if ( !ds ) return 0;
+
+    ds->~decode_state();
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+int lua_rapidxml_yieldable( lua_State *L )
+{
+#if LUA_VERSION_NUM >= 503
+    return lua_isyieldable( L );
+#elif LUA_VERSION_NUM == 502
+    int main = lua_pushthread( L );
+    lua_pop( L,1 );
+    return !main;
+#else
+    return 0;
+#endif
+}
+
+/* run one slice,return 1 if finish,0 if budget used up,-1 if error */
+int decode_slice_run( lua_State *L,decode_state *ds,int yieldable,char *msg )
+{
+    int return_code = 0;
+    try
+    {
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+
+        int done = 0;
+        int step = DECODE_STEP;
+        if ( ds->nodes > 0 && ds->nodes < step ) step = ds->nodes;
+        do
+        {
+            return_code = token_decode( L,&ds->td,step,msg );
+            if ( 0 != return_code || !yieldable ) continue;
+
+            done += step;
+            if ( ds->nodes > 0 && done >= ds->nodes ) break;
+            if ( ds->usec > 0 && std::chrono::duration_cast<
+                std::chrono::microseconds>( std::chrono::steady_clock::now()
+                - start ).count() >= ds->usec )
+            {
+                break;
+            }
+        } while ( 0 == return_code );
+    }
+    catch (const std::exception& e)
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"xml decode fail",e.what() );
+    }
+
+    return return_code;
+}
+
+#if LUA_VERSION_NUM >= 503
+int decode_slice_k( lua_State *L,int status,lua_KContext ctx );
+#elif LUA_VERSION_NUM == 502
+int decode_slice_k( lua_State *L );
+#endif
+
+/* the userdata state is at index 3,tables above it */
+int decode_slice( lua_State *L )
+{
+    decode_state *ds = (decode_state *)lua_touserdata( L,3 );
+
+    /* drop what was passed by resume */
+    if ( ds->top > 0 ) lua_settop( L,ds->top );
+
+    char msg[MAX_MSG_LEN] = { 0 };
+    int yieldable = lua_rapidxml_yieldable( L );
+    int return_code = decode_slice_run( L,ds,yieldable,msg );
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    if ( 0 == return_code )
+    {
+        ds->top = lua_gettop( L );
+#if LUA_VERSION_NUM >= 502
+        return lua_yieldk( L,0,0,decode_slice_k );
+#endif
+    }
+
+    return 1;
+}
+
+#if LUA_VERSION_NUM >= 503
+int decode_slice_k( lua_State *L,int status,lua_KContext ctx )
+{
+    (void)status;
+    (void)ctx;
+    return decode_slice( L );
+}
+#elif LUA_VERSION_NUM == 502
+int decode_slice_k( lua_State *L )
+{
+    return decode_slice( L );
+}
+#endif
+
+int decode_sliced( lua_State *L,int nodes,int usec )
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+
+    lua_settop( L,2 );
+    decode_state *ds = (decode_state *)lua_newuserdata( L,sizeof(decode_state) );
+    new (ds) decode_state();
+    luaL_getmetatable( L,DECODE_STATE_MT );
+    lua_setmetatable( L,-2 );
+
+    token_decoder_init( &ds->td,str,len );
+    ds->nodes = nodes;
+    ds->usec  = usec;
+    ds->top   = 0;
+
+    return decode_slice( L );
+}
+
+/* decode( str,opts ) */
+/* 1 if options at index ask for a time-sliced decode */
+int decode_yielding( lua_State *L,int index )
+{
+    lua_getfield( L,index,"yield_nodes" );
+    lua_getfield( L,index,"yield_time" );
+    int yielding = lua_tointeger( L,-2 ) > 0 || lua_tointeger( L,-1 ) > 0;
+    lua_pop( L,2 );
+
+    return yielding;
+}
+
+int decode_option( lua_State *L )
+{
+    lua_getfield( L,2,"yield_nodes" );
+    lua_getfield( L,2,"yield_time" );
+    int nodes = (int)lua_tointeger( L,-2 );
+    int usec  = (int)lua_tointeger( L,-1 );
+    lua_pop( L,2 );
+
+    if ( nodes > 0 || usec > 0 ) return decode_sliced( L,nodes,usec );
+
+    lua_settop( L,1 );
+    return 0;
+}
+
+int decode( lua_State *L )
+{
+    if ( lua_isnumber( L,2 ) ) return decode_buffer( L );
+
+    if ( slice_option( L,2 ) > 0 ) return decode_slices( L,0 );
+    if ( compact_option( L,2 ) ) return decode_compact( L,0 );
+    if ( lua_istable( L,2 ) )
+    {
+        lua_getfield( L,2,"into" );
+        int into = lua_istable( L,-1 );
+        lua_pop( L,1 );
+        if ( into ) return decode_into( L );
+    }
+
+    int lazy = 0;
+    if ( cache_option( L,2,0,&lazy ) )
+    {
+        /* a cache hit has nothing to slice */
+        if ( decode_yielding( L,2 ) )
+        {
+            return luaL_error( L,"cache can't be used with yield_nodes or yield_time" );
+        }
+        return decode_cached( L,0,lazy );
+    }
+    if ( lua_istable( L,2 ) && 0 != decode_option( L ) ) return 1;
+
+    const char *str = luaL_checkstring( L,1 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+
+    {
+        rapidxml::xml_document<> doc;
+        try
+        {
+            /* nerver modify str */
+            doc.parse<rapidxml::parse_non_destructive>( const_cast<char *>(str) );
+            return_code = decode_element( L,doc.first_node(),msg );
+        }
+        catch ( const std::runtime_error& e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        /* rapidxml static memory pool will never free,until you call clear */
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+int decode_from_file( lua_State *L )
+{
+    if ( slice_option( L,2 ) > 0 ) return decode_slices( L,1 );
+    if ( compact_option( L,2 ) ) return decode_compact( L,1 );
+
+    int lazy = 0;
+    if ( cache_option( L,2,1,&lazy ) ) return decode_cached( L,1,lazy );
+
+    const char *path = luaL_checkstring( L,1 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    /* luaL_error do a longjump,conflict with C++ stack unwind
+     * so we make a code block here
+     */
+    {
+        rapidxml::xml_document<> doc;
+        try
+        {
+            rapidxml::file<> in( path );
+            /* nerver modify str */
+            doc.parse<rapidxml::parse_non_destructive>( const_cast<char *>(in.data()) );
+            return_code = decode_element( L,doc.first_node(),msg );
+        }
+        catch ( const std::runtime_error& e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        /* rapidxml static memory pool will never free,until you call clear */
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* path like "root/library/name","*" match any element name */
+typedef std::vector<std::string> select_path;
+
+struct select_ctx
+{
+    std::vector<select_path> paths;
+    std::vector< std::pair<const char *,size_t> > names; /* current path */
+    int filter;                                          /* predicate index */
+};
+
+void select_parse_path( const char *path,size_t len,select_path &segs )
+{
+    const char *end = path + len;
+    while ( path < end )
+    {
+        const char *slash = (const char *)memchr( path,'/',end - path );
+        if ( !slash ) slash = end;
+
+        if ( slash > path ) segs.push_back( std::string( path,slash - path ) );
+        path = slash + 1;
+    }
+}
+
+/* 1 if path match current element,0 if a child may match,-1 skip subtree */
+int select_match_path( select_ctx *ctx )
+{
+    int skip = -1;
+    size_t depth = ctx->names.size();
+    for ( size_t i = 0;i < ctx->paths.size(); ++i )
+    {
+        const select_path &segs = ctx->paths[i];
+        if ( segs.size() < depth ) continue;
+
+        size_t j = 0;
+        for ( ;j < depth; ++j )
+        {
+            const std::string &seg = segs[j];
+            if ( seg.size() == 1 && '*' == seg[0] ) continue;
+            if ( seg.size() != ctx->names[j].second
+                || 0 != memcmp( seg.c_str(),ctx->names[j].first,seg.size() ) )
+            {
+                break;
+            }
+        }
+
+        if ( j < depth ) continue;
+        if ( segs.size() == depth ) return 1;
+
+        skip = 0;
+    }
+
+    return skip;
+}
+
+/* call lua predicate function( name,depth ),1 if match,0 if not */
+int select_match_filter( lua_State *L,select_ctx *ctx,char *msg )
+{
+    lua_pushvalue( L,ctx->filter );
+    lua_pushlstring( L,ctx->names.back().first,ctx->names.back().second );
+    lua_pushinteger( L,(lua_Integer)ctx->names.size() );
+    if ( 0 != lua_pcall( L,2,1,0 ) )
+    {
+        MARK_ERROR( msg,"decode select",lua_rapidxml_errmsg( L,-1 ) );
+        lua_pop( L,1 );
+        return -1;
+    }
+
+    int match = lua_toboolean( L,-1 );
+    lua_pop( L,1 );
+
+    return match;
+}
+
+/* parse a matched element [begin,end) with rapidxml and push the table */
+int select_decode_span( lua_State *L,rapidxml::xml_document<> *doc,
+    std::vector<char> &buffer,const char *begin,const char *end,char *msg )
+{
+    /* rapidxml need a '\0' terminated string,copy the matched span only */
+    buffer.assign( begin,end );
+    buffer.push_back( 0 );
+
+    doc->parse<rapidxml::parse_non_destructive>( &buffer[0] );
+    int return_code = decode_element( L,doc->first_node(),msg );
+
+    doc->clear();
+    return return_code;
+}
+
+int select_scan( lua_State *L,select_ctx *ctx,rapidxml::xml_document<> *doc,
+    const char *str,size_t len,char *msg )
+{
+    int index = 1;
+    xml_token tk;
+    xml_scanner s;
+    std::vector<char> buffer;
+
+    scan_init( &s,str,str + len );
+    while ( true )
+    {
+        switch ( scan_token( &s,&tk,1 ) )
+        {
+        case XS_EOF : return 0;
+        case XS_ERROR :
+            MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+            return -1;
+        case XS_TEXT :
+            if ( !tk.blank && 0 == s.depth )
+            {
+                scan_error( &tk,tk.begin,"expected <" );
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+                return -1;
+            }
+            break;
+        case XS_END : ctx->names.pop_back(); break;
+        case XS_START :
+        case XS_EMPTY :
+        {
+            const char *begin = tk.begin;
+            ctx->names.push_back( std::make_pair( tk.name,tk.name_len ) );
+
+            int match = ctx->filter ?
+                select_match_filter( L,ctx,msg ) : select_match_path( ctx );
+            if ( match < 0 && !ctx->filter )
+            {
+                /* no path under this element,skip without decode */
+                if ( XS_START == tk.type
+                    && XS_ERROR == scan_skip_element( &s,&tk,1 ) )
+                {
+                    MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+                    return -1;
+                }
+                ctx->names.pop_back();
+                break;
+            }
+            else if ( match < 0 )
+            {
+                return -1;
+            }
+            else if ( 0 == match )
+            {
+                if ( XS_EMPTY == tk.type ) ctx->names.pop_back();
+                break;
+            }
+
+            if ( XS_START == tk.type
+                && XS_ERROR == scan_skip_element( &s,&tk,1 ) )
+            {
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+                return -1;
+            }
+            ctx->names.pop_back();
+
+            if ( select_decode_span( L,doc,buffer,begin,tk.end,msg ) < 0 )
+            {
+                return -1;
+            }
+            lua_rawseti( L,-2,index );
+            ++index;
+        }break;
+        default : break;
+        }
+    }
+
+    return 0;
+}
+
+/* decode only the elements which match the paths(or the predicate),other
+ * subtree is skipped by the scanner without building any node
+ */
+int decode_select( lua_State *L )
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+
+    int type = lua_type( L,2 );
+    if ( LUA_TTABLE != type && LUA_TFUNCTION != type )
+    {
+        return luaL_error( L,"argument #2 path table or function expect" );
+    }
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+
+    lua_settop( L,2 );
+    lua_newtable( L );
+    {
+        select_ctx ctx;
+        rapidxml::xml_document<> doc;
+        try
+        {
+            ctx.filter = LUA_TFUNCTION == type ? 2 : 0;
+            if ( !ctx.filter )
+            {
+                size_t n = lua_rawlen( L,2 );
+                for ( size_t i = 1;i <= n; ++i )
+                {
+                    lua_rawgeti( L,2,i );
+                    size_t path_len = 0;
+                    const char *path = lua_tolstring( L,-1,&path_len );
+                    if ( path )
+                    {
+                        ctx.paths.push_back( select_path() );
+                        select_parse_path( path,path_len,ctx.paths.back() );
+                    }
+                    lua_pop( L,1 );
+                }
+            }
+
+            return_code = select_scan( L,&ctx,&doc,str,len,msg );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* ============================ record stream =============================== */
+/* cut out the elements at a given depth from data that arrive piece by piece.
+ * the buffer only keep the unfinished record,consumed data are dropped when
+ * new data come in,so memory stay flat however large the whole input is.
+ */
+#define RECORD_CHUNK (64*1024)
+
+struct record_stream
+{
+    std::string buffer;
+    size_t pos;        /* scan position in buffer */
+    size_t begin;      /* start of the unfinished record,npos if none */
+    int depth;         /* scanner depth at pos */
+    int record_depth;  /* 1 is the root element */
+    int started;       /* bom had been checked */
+};
+
+void record_init( record_stream *rs,int record_depth )
+{
+    rs->buffer.clear();
+    rs->pos     = 0;
+    rs->begin   = std::string::npos;
+    rs->depth   = 0;
+    rs->started = 0;
+    rs->record_depth = record_depth;
+}
+
+void record_feed( record_stream *rs,const char *data,size_t len )
+{
+    /* drop what had been consumed before append */
+    size_t keep = std::string::npos != rs->begin ? rs->begin : rs->pos;
+    if ( keep > 0 )
+    {
+        rs->buffer.erase( 0,keep );
+        rs->pos -= keep;
+        if ( std::string::npos != rs->begin ) rs->begin -= keep;
+    }
+
+    rs->buffer.append( data,len );
+}
+
+/* find next record,[*rb,*re) is the offset of record in buffer
+ * return 1 if a record found,0 if need more data(or finish at eof),-1 error
+ */
+int record_next( record_stream *rs,int eof,size_t *rb,size_t *re,char *msg )
+{
+    const char *base = rs->buffer.c_str();
+
+    xml_token tk;
+    xml_scanner s;
+    if ( !rs->started )
+    {
+        /* bom only at the very beginning */
+        if ( rs->buffer.size() < 3 && !eof ) return 0;
+
+        scan_init( &s,base,base + rs->buffer.size() );
+        rs->started = 1;
+    }
+    else
+    {
+        s.cur = base + rs->pos;
+        s.end = base + rs->buffer.size();
+    }
+    s.depth = rs->depth;
+
+    int found = 0;
+    while ( !found )
+    {
+        switch ( scan_token( &s,&tk,eof ) )
+        {
+        case XS_MORE : goto DONE;
+        case XS_EOF  :
+            if ( 0 != s.depth )
+            {
+                scan_incomplete( &s,&tk,eof );
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,base );
+                return -1;
+            }
+            goto DONE;
+        case XS_ERROR :
+            MARK_SCAN_ERROR( msg,"invalid xml string",tk,base );
+            return -1;
+        case XS_TEXT :
+            if ( !tk.blank && 0 == s.depth )
+            {
+                scan_error( &tk,tk.begin,"expected <" );
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,base );
+                return -1;
+            }
+            break;
+        case XS_START :
+            if ( s.depth == rs->record_depth ) rs->begin = tk.begin - base;
+            break;
+        case XS_EMPTY :
+            if ( s.depth + 1 == rs->record_depth )
+            {
+                *rb = tk.begin - base;
+                found = 1;
+            }
+            break;
+        case XS_END :
+            if ( s.depth + 1 == rs->record_depth )
+            {
+                *rb = rs->begin;
+                rs->begin = std::string::npos;
+                found = 1;
+            }
+            break;
+        }
+    }
+    *re = tk.end - base;
+
+DONE:
+    rs->pos   = s.cur - base;
+    rs->depth = s.depth;
+    return found;
+}
+
+/* decode record [rb,re) in place and push the table */
+int record_decode( lua_State *L,record_stream *rs,
+    rapidxml::xml_document<> *doc,size_t rb,size_t re,char *msg )
+{
+    /* the buffer is ours,so terminate the record temporarily instead of
+     * copying it.std::string always keep a '\0' after the last char
+     */
+    char *base = &rs->buffer[0];
+    char tail  = base[re];
+    base[re]   = 0;
+
+    int return_code = 0;
+    try
+    {
+        doc->parse<rapidxml::parse_non_destructive>( base + rb );
+        return_code = decode_element( L,doc->first_node(),msg );
+    }
+    catch (...)
+    {
+        base[re] = tail;
+        doc->clear();
+        throw;
+    }
+
+    base[re] = tail;
+    /* rewind the memory pool,record memory never pile up */
+    doc->clear();
+
+    return return_code;
+}
+
+/* call fn( tb ) for every element at depth,return false in fn to stop */
+int record_each( lua_State *L,record_stream *rs,
+    rapidxml::xml_document<> *doc,std::ifstream &in,int *count,char *msg )
+{
+    std::vector<char> chunk( RECORD_CHUNK );
+
+    int eof = 0;
+    while ( true )
+    {
+        size_t rb = 0;
+        size_t re = 0;
+        int found = record_next( rs,eof,&rb,&re,msg );
+        if ( found < 0 ) return -1;
+        if ( 0 == found )
+        {
+            if ( eof ) return 0;
+
+            in.read( &chunk[0],chunk.size() );
+            if ( in.bad() )
+            {
+                MARK_ERROR( msg,"each record","read file fail" );
+                return -1;
+            }
+
+            eof = in.eof() ? 1 : 0;
+            record_feed( rs,&chunk[0],in.gcount() );
+            continue;
+        }
+
+        lua_pushvalue( L,3 );
+        if ( record_decode( L,rs,doc,rb,re,msg ) < 0 )
+        {
+            lua_pop( L,1 );
+            return -1;
+        }
+
+        ++(*count);
+        if ( 0 != lua_pcall( L,1,1,0 ) )
+        {
+            MARK_ERROR( msg,"each record",lua_rapidxml_errmsg( L,-1 ) );
+            lua_pop( L,1 );
+            return -1;
+        }
+
+        int stop = lua_isboolean( L,-1 ) && !lua_toboolean( L,-1 );
+        lua_pop( L,1 );
+        if ( stop ) return 0;
+    }
+
+    return 0;
+}
+
+/* each_record( file,depth,fn ),depth 1 is the root element.the file is read
+ * piece by piece,a record is decoded and dropped before next one
+ */
+int each_record( lua_State *L )
+{
+    const char *path = luaL_checkstring( L,1 );
+    int depth = (int)luaL_checkinteger( L,2 );
+    luaL_checktype( L,3,LUA_TFUNCTION );
+    if ( depth < 1 )
+    {
+        return luaL_error( L,"argument #2 depth must great than 0" );
+    }
+
+    int count = 0;
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    /* luaL_error do a longjump,conflict with C++ stack unwind
+     * so we make a code block here
+     */
+    {
+        record_stream rs;
+        rapidxml::xml_document<> doc;
+        try
+        {
+            std::ifstream in( path,std::ios::binary );
+            if ( !in )
+            {
+                throw std::runtime_error( std::string("cannot open file ") + path );
+            }
+
+            record_init( &rs,depth );
+            return_code = record_each( L,&rs,&doc,in,&count,msg );
+        }
+        catch ( const std::runtime_error& e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    lua_pushinteger( L,count );
+    return 1;
+}
+
+/* ============================ push parser ================================= */
+/* local parser = xml.parser( depth )
+ * parser:feed( chunk ) return the elements at depth completed by this chunk
+ * parser:finish() make sure the input is complete and reset the parser
+ */
+#define PARSER_MT "lua_rapidxml.parser"
+
+struct xml_parser
+{
+    record_stream rs;
+};
+
+/* decode every complete record and push a array of them */
+int parser_collect( lua_State *L,xml_parser *parser,int eof,char *msg )
+{
+    int return_code = 0;
+    lua_newtable( L );
+    {
+        rapidxml::xml_document<> doc;
+        try
+        {
+            int index = 1;
+            size_t rb = 0;
+            size_t re = 0;
+            while ( ( return_code = record_next( &parser->rs,eof,&rb,&re,msg ) ) > 0 )
+            {
+                return_code = record_decode( L,&parser->rs,&doc,rb,re,msg );
+                if ( return_code < 0 ) break;
+
+                lua_rawseti( L,-2,index );
+                ++index;
+            }
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        doc.clear();
+    }
+
+    /* a broken stream can't resume,start over */
+    if ( return_code < 0 || eof )
+    {
+        record_init( &parser->rs,parser->rs.record_depth );
+    }
+
+    return return_code;
+}
+
+int parser_feed( lua_State *L )
+{
+    xml_parser *parser = (xml_parser *)luaL_checkudata( L,1,PARSER_MT );
+
+    size_t len = 0;
+    const char *chunk = luaL_checklstring( L,2,&len );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    try
+    {
+        record_feed( &parser->rs,chunk,len );
+    }
+    catch (const std::exception& e)
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"parser feed",e.what() );
+    }
+
+    if ( return_code < 0 || parser_collect( L,parser,0,msg ) < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+int parser_finish( lua_State *L )
+{
+    xml_parser *parser = (xml_parser *)luaL_checkudata( L,1,PARSER_MT );
+
+    char msg[MAX_MSG_LEN] = { 0 };
+    if ( parser_collect( L,parser,1,msg ) < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+int parser_reset( lua_State *L )
+{
+    xml_parser *parser = (xml_parser *)luaL_checkudata( L,1,PARSER_MT );
+    record_init( &parser->rs,parser->rs.record_depth );
+
+    return 0;
+}
+
+int parser_gc( lua_State *L )
+{
+    xml_parser *parser = (xml_parser *)lua_rapidxml_gc_udata( L,PARSER_MT );
+    if ( !parser ) return 0;
+
+    parser->~xml_parser();
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+/* parser( depth ),depth default 1,emit every top level element */
+int parser( lua_State *L )
+{
+    int depth = (int)luaL_optinteger( L,1,1 );
+    if ( depth < 1 )
+    {
+        return luaL_error( L,"argument #1 depth must great than 0" );
+    }
+
+    xml_parser *parser = (xml_parser *)lua_newuserdata( L,sizeof(xml_parser) );
+    new (parser) xml_parser();
+    record_init( &parser->rs,depth );
+
+    luaL_getmetatable( L,PARSER_MT );
+    lua_setmetatable( L,-2 );
+
+    return 1;
+}
+
+/* ============================ async decode ================================ */
+/* local handle = xml.decode_async( str )
+ * a worker thread parse str into a rapidxml document,the lua thread poll
+ * handle:done() and convert the document to table by handle:result().
+ * str is referenced by the handle until result,so it's never copied
+ */
+#define ASYNC_MT "lua_rapidxml.async"
+
+enum
+{
+    ASYNC_RUNNING = 0,
+    ASYNC_DONE    = 1,
+    ASYNC_FAIL    = 2,
+    ASYNC_TAKEN   = 3  /* result had been taken */
+};
+
+struct xml_async
+{
+    std::thread worker;
+    std::atomic<int> state;
+    int ref;           /* reference of str in registry */
+    const char *str;
+    char msg[MAX_MSG_LEN];
+    rapidxml::xml_document<> doc;
+};
+
+void async_parse( xml_async *async )
+{
+    int state = ASYNC_DONE;
+    try
+    {
+        /* nerver modify str */
+        async->doc.parse<rapidxml::parse_non_destructive>(
+            const_cast<char *>(async->str) );
+    }
+    catch (const rapidxml::parse_error& e)
+    {
+        state = ASYNC_FAIL;
+        MARK_ERROR( async->msg,"invalid xml string",e.what() );
+    }
+    catch (const std::exception& e)
+    {
+        state = ASYNC_FAIL;
+        MARK_ERROR( async->msg,"xml decode fail",e.what() );
+    }
+    catch (...)
+    {
+        state = ASYNC_FAIL;
+        MARK_ERROR( async->msg,"xml decode fail","unknow error" );
+    }
+
+    async->state.store( state,std::memory_order_release );
+}
+
+/* wait for the worker and release the str */
+void async_join( lua_State *L,xml_async *async )
+{
+    if ( async->worker.joinable() ) async->worker.join();
+
+    if ( LUA_NOREF != async->ref )
+    {
+        luaL_unref( L,LUA_REGISTRYINDEX,async->ref );
+        async->ref = LUA_NOREF;
+    }
+}
+
+int async_done( lua_State *L )
+{
+    xml_async *async = (xml_async *)luaL_checkudata( L,1,ASYNC_MT );
+
+    int state = async->state.load( std::memory_order_acquire );
+    lua_pushboolean( L,ASYNC_RUNNING != state );
+    return 1;
+}
+
+/* block until the worker finish if it's not done yet */
+int async_result( lua_State *L )
+{
+    xml_async *async = (xml_async *)luaL_checkudata( L,1,ASYNC_MT );
+
+    async_join( L,async );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    switch ( async->state.load( std::memory_order_acquire ) )
+    {
+    case ASYNC_DONE :
+        return_code = decode_element( L,async->doc.first_node(),msg );
+        break;
+    case ASYNC_FAIL :
+        return_code = -1;
+        memcpy( msg,async->msg,MAX_MSG_LEN );
+        break;
+    default :
+        return_code = -1;
+        MARK_ERROR( msg,"async decode","result had been taken" );
+        break;
+    }
+
+    /* rapidxml static memory pool will never free,until you call clear */
+    async->state.store( ASYNC_TAKEN,std::memory_order_relaxed );
+    async->doc.clear();
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+int async_gc( lua_State *L )
+{
+    xml_async *async = (xml_async *)lua_rapidxml_gc_udata( L,ASYNC_MT );
+    if ( !async ) return 0;
+
+    async_join( L,async );
+    async->doc.clear();
+    async->~xml_async();
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+int decode_async( lua_State *L )
+{
+    const char *str = luaL_checkstring( L,1 );
+
+    xml_async *async = (xml_async *)lua_newuserdata( L,sizeof(xml_async) );
+    new (async) xml_async();
+    async->state.store( ASYNC_RUNNING,std::memory_order_relaxed );
+    async->str = str;
+    async->msg[0] = 0;
+
+    luaL_getmetatable( L,ASYNC_MT );
+    lua_setmetatable( L,-2 );
+
+    /* keep str alive until the worker finish */
+    lua_pushvalue( L,1 );
+    async->ref = luaL_ref( L,LUA_REGISTRYINDEX );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    try
+    {
+        async->worker = std::thread( async_parse,async );
+    }
+    catch (const std::exception& e)
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"async decode",e.what() );
+    }
+
+    if ( return_code < 0 )
+    {
+        async->state.store( ASYNC_TAKEN,std::memory_order_relaxed );
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* format a number into buffer(at least 64 bytes),return the length */
+size_t encode_number( double val,char *buffer )
+{
+    if ( floor(val) == val ) /* integer */
+    {
+        /* snprintf is slow,format a exact integer by hand.-0 and huge
+         * number still go to "%.0f"
+         */
+        if ( fabs( val ) < 1e15 && !( 0 == val && std::signbit( val ) ) )
+        {
+            char _digit[24];
+            long long ival = (long long)val;
+            unsigned long long uval = ival < 0 ? -ival : ival;
+            size_t len = 0;
+            do
+            {
+                _digit[len++] = (char)( '0' + uval % 10 );
+                uval /= 10;
+            } while ( uval > 0 );
+
+            size_t pos = 0;
+            if ( ival < 0 ) buffer[pos++] = '-';
+            while ( len > 0 ) buffer[pos++] = _digit[--len];
+            buffer[pos] = 0;
+
+            return pos;
+        }
+        return snprintf( buffer,64,"%.0f",val );
+    }
+
+    return snprintf( buffer,64,"%f",val );
+}
+
+/* extra_keys option at index,"error"(default) or "ignore".return 1 if keys
+ * outside the sequence of a value array are ignored
+ */
+int extra_keys_option( lua_State *L,int index )
+{
+    if ( !lua_istable( L,index ) ) return 0;
+
+    lua_getfield( L,index,"extra_keys" );
+    const char *policy = lua_tostring( L,-1 );
+    int ignore = policy && 0 == strcmp( policy,"ignore" );
+    if ( policy && !ignore && 0 != strcmp( policy,"error" ) )
+    {
+        return luaL_error( L,"extra_keys must be \"error\" or \"ignore\"" );
+    }
+    lua_pop( L,1 );
+
+    return ignore;
+}
+
+/* 1 if value array at index has any key outside 1..count */
+int value_extra_keys( lua_State *L,int index,int count )
+{
+    int keys = 0;
+    lua_pushnil( L );
+    while ( 0 != lua_next( L,index ) )
+    {
+        lua_pop( L,1 );
+        if ( ++keys > count )
+        {
+            lua_pop( L,1 );
+            return 1;
+        }
+    }
+
+    return keys != count;
+}
+
+rapidxml::xml_node<> *encode_element( lua_State *L,int index,
+    rapidxml::xml_document<> *doc,int ignore_extra,char *msg )
+{
+    if ( !lua_istable( L,index ) )
+    {
+        MARK_ERROR( msg,"encode element","not a valid table" );
+        return NULL;
+    }
+
+    int top = lua_gettop( L );
+    if ( top > MAX_STACK )
+    {
+        MARK_ERROR( msg,"encode element","stack overflow" );
+        return NULL;
+    }
+
+    if ( !lua_checkstack( L,3 ) )
+    {
+        MARK_ERROR( msg,"encode element","out of stack" );
+        return NULL;
+    }
+
+    lua_pushstring( L,NAME_KEY );
+    lua_rawget( L,index );
+    if ( !lua_isstring( L,top + 1 ) )
+    {
+        lua_settop( L,top );
+        MARK_ERROR( msg,"encode element","node name must be string" );
+        return NULL;
+    }
+    rapidxml::xml_node<>* child = NULL;
+
+    size_t name_len = 0;
+    const char *name = lua_tolstring( L,-1,&name_len );
+    /* a lua string stay alive as long as the argument table,refer to it
+     * directly.a number is converted on stack only,so copy it.do't worry
+     * about memory leak here,doc.clear() will free all
+     */
+    if ( LUA_TSTRING != lua_type( L,-1 ) )
+    {
+        name = doc->allocate_string( name,name_len );
+    }
+    lua_pop( L,1 ); /* pop name */
+
+    lua_pushstring( L,VALUE_KEY );
+    lua_rawget( L,index );
+    switch ( lua_type( L,-1 ) )
+    {
+    case LUA_TNIL :
+    {
+        /* childless node,has no value and child node */
+        child = doc->allocate_node( rapidxml::node_element,name,0,name_len,0 );
+    }break;
+    case LUA_TNUMBER :
+    {
+        char _buffer[64];
+        size_t val_len = encode_number( lua_tonumber( L,-1 ),_buffer );
+        const char *value = doc->allocate_string( _buffer,val_len );
+        child = doc->allocate_node( 
+            rapidxml::node_element,name,value,name_len,val_len );
+    }break;
+    case LUA_TSTRING :
+    {
+        size_t val_len = 0;
+        const char *value = lua_tolstring( L,-1,&val_len );
+        child = doc->allocate_node( 
+            rapidxml::node_element,name,value,name_len,val_len );
+    }break;
+    case LUA_TUSERDATA :
+    {
+        /* a slice,it's source is kept alive by the argument table too */
+        size_t val_len = 0;
+        const char *value = NULL;
+        if ( !slice_view( L,-1,&value,&val_len ) )
+        {
+            lua_settop( L,top );
+            MARK_ERROR( msg,"encode element","unsupport value type" );
+            return NULL;
+        }
+        child = doc->allocate_node( 
+            rapidxml::node_element,name,value,name_len,val_len );
+    }break;
+    case LUA_TTABLE :
+    {
+        child = doc->allocate_node( rapidxml::node_element,name,0,name_len );
+        if ( encode_node( L,top + 1,doc,child,ignore_extra,msg ) < 0 )
+        {
+            lua_settop( L,top );
+            return NULL;
+        }
+    }break;
+    default:
+        lua_settop( L,top );
+        MARK_ERROR( msg,"encode element","unsupport value type" );
+        return NULL;
+    }
+    lua_pop( L,1 ); /* pop value */
+
+    assert( child );
+    lua_pushstring( L,ATTR_KEY );
+    lua_rawget( L,index );
+    int type = lua_type( L,-1 );
+    if ( LUA_TNIL != type ) /* nil means no attribute,do nothing */
+    {
+        if ( LUA_TTABLE != type )
+        {
+            lua_settop( L,top );
+            MARK_ERROR( msg,"encode element","attribute must be a table" );
+            return NULL;
+        }
+
+        lua_pushnil( L );
+        while ( 0 != lua_next( L,-2 ) )
+        {
+            if ( LUA_TSTRING != lua_type( L,-1 ) 
+                || LUA_TSTRING != lua_type( L,-2 ) )
+            {
+                lua_settop( L,top );
+                MARK_ERROR( msg,"encode element",
+                    "all attribute key and value must be string" );
+                return NULL;
+            }
+            size_t key_len = 0;
+            size_t val_len = 0;
+            const char *key = lua_tolstring( L,-2,&key_len );
+            const char *val = lua_tolstring( L,-1,&val_len );
+
+            child->append_attribute( 
+                doc->allocate_attribute( key,val,key_len,val_len ) );
+
+            lua_pop( L,1 );
+        }
+    }
+    lua_pop( L,1 ); /* pop attribute */
+
+    return child;
+}
+
+int encode_node( lua_State *L,int index,rapidxml::xml_document<> *doc,
+    rapidxml::xml_node<> *node,int ignore_extra,char *msg )
+{
+    if ( !lua_istable( L,index ) )
+    {
+        MARK_ERROR( msg,"encode node","not a valid table" );
+        return -1;
+    }
+
+    int top = lua_gettop( L );
+    if ( top > MAX_STACK )
+    {
+        MARK_ERROR( msg,"encode node","stack overflow" );
+        return -1;
+    }
+
+    if ( !lua_checkstack( L,5 ) )
+    {
+        MARK_ERROR( msg,"encode node","out of stack" );
+        return -1;
+    }
+
+    /* only the sequence 1..n is encoded,in order.other keys are a error
+     * unless ignore_extra
+     */
+    int count = (int)lua_rawlen( L,index );
+    if ( !ignore_extra && value_extra_keys( L,index,count ) )
+    {
+        MARK_ERROR( msg,"encode node","value array has non-sequence key" );
+        return -1;
+    }
+    for ( int i = 1;i <= count; ++i )
+    {
+        lua_rawgeti( L,index,i );
+        rapidxml::xml_node<> *child = 0;
+        /* if type is number or string,this node is data_node */
+        switch( lua_type( L,-1 ) )
+        {
+        case LUA_TNUMBER :
+        {
+            char _buffer[64];
+            size_t val_len = encode_number( lua_tonumber( L,-1 ),_buffer );
+            const char *value = doc->allocate_string( _buffer,val_len );
+            child = doc->allocate_node( rapidxml::node_data,0,value,0,val_len );
+        }break;
+        case LUA_TSTRING :
+        {
+            size_t val_len = 0;
+            const char *value = lua_tolstring( L,-1,&val_len );
+            child = doc->allocate_node( rapidxml::node_data,0,value,0,val_len );
+        }break;
+        case LUA_TUSERDATA :
+        {
+            size_t val_len = 0;
+            const char *value = NULL;
+            if ( !slice_view( L,-1,&value,&val_len ) )
+            {
+                lua_settop( L,top );
+                MARK_ERROR( msg,
+                    "encode node","node must be number,string or table" );
+                return -1;
+            }
+            child = doc->allocate_node( rapidxml::node_data,0,value,0,val_len );
+        }break;
+        case LUA_TTABLE :
+        {
+            child = encode_element( L,top + 1,doc,ignore_extra,msg );
+            if ( !child )
+            {
+                lua_settop( L,top );
+                return -1;
+            }
+        }break;
+        default :
+            lua_settop( L,top );
+            MARK_ERROR( msg,
+                "encode node","node must be number,string or table" );
+            return -1;
+        }
+
+        assert( child );
+        node->append_node( child );
+
+        lua_pop( L,1 ); /* pop value,go to next */
+    }
+
+    return 0;
+}
+
+/* ============================ xml writer ================================== */
+/* write a table as xml text directly,without building the whole document.
+ * every node is printed by rapidxml::internal::print_node from a temporary
+ * node pointing at lua strings,so the output is byte to byte the same as
+ * rapidxml::print of the document built by encode_element.every open element
+ * keep it's table,name and value table on lua stack and the rest of state in a
+ * frame,so it can stop after any node and continue later
+ */
+#define XML_PI "xml version=\"1.0\" encoding=\"utf-8\""
+
+struct writer_frame
+{
+    int index;  /* stack index of value table,name at index - 1 */
+    int next;   /* next value to write */
+    int count;
+    int indent;
+};
+
+struct xml_writer
+{
+    std::vector<writer_frame> frames;
+    std::vector< rapidxml::xml_attribute<> > attrs; /* of current element */
+    std::string out;
+    int root;     /* stack index of root table */
+    int pretty;
+    int ignore_extra; /* ignore keys outside the sequence of a value array */
+    int started;
+    int done;
+};
+
+void writer_init( xml_writer *w,int root,int pretty,int ignore_extra )
+{
+    w->frames.clear();
+    w->attrs.clear();
+    w->out.clear();
+    w->root    = root;
+    w->pretty  = pretty;
+    w->ignore_extra = ignore_extra;
+    w->started = 0;
+    w->done    = 0;
+}
+
+void writer_escape( std::string &out,const char *str,size_t len,char noexpand )
+{
+    rapidxml::internal::copy_and_expand_chars(
+        str,str + len,noexpand,std::back_inserter( out ) );
+}
+
+/* print a node,with a line break after it if pretty */
+void writer_print( std::string &out,const rapidxml::xml_node<> *node,
+    int pretty,int indent )
+{
+    rapidxml::internal::print_node( std::back_inserter( out ),node,
+        pretty ? 0 : rapidxml::print_no_indenting,indent );
+}
+
+void writer_declaration( std::string &out,int pretty )
+{
+    rapidxml::xml_node<> pi( rapidxml::node_pi );
+    pi.name( XML_PI,sizeof( XML_PI ) - 1 );
+    writer_print( out,&pi,pretty,0 );
+}
+
+void writer_newline( xml_writer *w )
+{
+    if ( w->pretty ) w->out.push_back( '\n' );
+}
+
+/* text of a number,string or slice at index,a number is formatted into buffer
+ * which must hold 64 bytes
+ */
+const char *writer_text( lua_State *L,int index,char *buffer,size_t *len )
+{
+    if ( LUA_TNUMBER == lua_type( L,index ) )
+    {
+        *len = encode_number( lua_tonumber( L,index ),buffer );
+        return buffer;
+    }
+
+    const char *val = NULL;
+    if ( !slice_view( L,index,&val,len ) )
+    {
+        val = lua_tolstring( L,index,len );
+    }
+    return val;
+}
+
+/* 1 if value at index is a text,0 if a empty text,-1 if not a text */
+int writer_is_text( lua_State *L,int index )
+{
+    const char *val = NULL;
+    size_t val_len = 0;
+    switch ( lua_type( L,index ) )
+    {
+    case LUA_TNUMBER : return 1;
+    case LUA_TSTRING : return lua_rawlen( L,index ) > 0 ? 1 : 0;
+    case LUA_TUSERDATA :
+        if ( !slice_view( L,index,&val,&val_len ) ) return -1;
+        return val_len > 0 ? 1 : 0;
+    default : return -1;
+    }
+}
+
+/* collect attributes of element at index into w->attrs,they point at the lua
+ * strings in the attribute table
+ */
+int writer_attribute( lua_State *L,xml_writer *w,int index,char *msg )
+{
+    w->attrs.clear();
+
+    lua_pushstring( L,ATTR_KEY );
+    lua_rawget( L,index );
+    int type = lua_type( L,-1 );
+    if ( LUA_TNIL == type ) /* nil means no attribute,do nothing */
+    {
+        lua_pop( L,1 );
+        return 0;
+    }
+    if ( LUA_TTABLE != type )
+    {
+        MARK_ERROR( msg,"encode element","attribute must be a table" );
+        return -1;
+    }
+
+    lua_pushnil( L );
+    while ( 0 != lua_next( L,-2 ) )
+    {
+        if ( LUA_TSTRING != lua_type( L,-1 )
+            || LUA_TSTRING != lua_type( L,-2 ) )
+        {
+            MARK_ERROR( msg,"encode element",
+                "all attribute key and value must be string" );
+            return -1;
+        }
+        size_t key_len = 0;
+        size_t val_len = 0;
+        const char *key = lua_tolstring( L,-2,&key_len );
+        const char *val = lua_tolstring( L,-1,&val_len );
+
+        w->attrs.push_back( rapidxml::xml_attribute<>() );
+        w->attrs.back().name( key,key_len );
+        w->attrs.back().value( val,val_len );
+
+        lua_pop( L,1 );
+    }
+    lua_pop( L,1 ); /* pop attribute */
+
+    return 0;
+}
+
+/* write the element at index(top of stack).if it has child nodes,push a frame
+ * and leave name,value table on stack,return 1.return 0 if it's complete,the
+ * element is popped then,like closing a frame do
+ */
+int writer_element( lua_State *L,xml_writer *w,int index,int indent,char *msg )
+{
+    if ( !lua_istable( L,index ) )
+    {
+        MARK_ERROR( msg,"encode element","not a valid table" );
+        return -1;
+    }
+
+    int top = lua_gettop( L );
+    if ( top > MAX_STACK )
+    {
+        MARK_ERROR( msg,"encode element","stack overflow" );
+        return -1;
+    }
+
+    if ( !lua_checkstack( L,5 ) )
+    {
+        MARK_ERROR( msg,"encode element","out of stack" );
+        return -1;
+    }
+
+    lua_pushstring( L,NAME_KEY );
+    lua_rawget( L,index );
+    if ( !lua_isstring( L,top + 1 ) )
+    {
+        MARK_ERROR( msg,"encode element","node name must be string" );
+        return -1;
+    }
+
+    size_t name_len = 0;
+    const char *name = lua_tolstring( L,top + 1,&name_len );
+
+    rapidxml::xml_node<> node( rapidxml::node_element );
+    node.name( name,name_len );
+    if ( writer_attribute( L,w,index,msg ) < 0 ) return -1;
+    for ( size_t i = 0;i < w->attrs.size(); ++i )
+    {
+        node.append_attribute( &w->attrs[i] );
+    }
+
+    lua_pushstring( L,VALUE_KEY );
+    lua_rawget( L,index );
+    int inline_index = top + 2;
+    switch ( lua_type( L,top + 2 ) )
+    {
+    case LUA_TNIL : inline_index = 0; break;
+    case LUA_TNUMBER : break;
+    case LUA_TSTRING :
+    case LUA_TUSERDATA :
+        switch ( writer_is_text( L,top + 2 ) )
+        {
+        case 0 : inline_index = 0; break;
+        case 1 : break;
+        default :
+            MARK_ERROR( msg,"encode element","unsupport value type" );
+            return -1;
+        }
+        break;
+    case LUA_TTABLE :
+    {
+        int count = (int)lua_rawlen( L,top + 2 );
+        if ( !w->ignore_extra && value_extra_keys( L,top + 2,count ) )
+        {
+            MARK_ERROR( msg,"encode node","value array has non-sequence key" );
+            return -1;
+        }
+        if ( 0 == count )
+        {
+            inline_index = 0;
+            break;
+        }
+
+        /* a sole data child is printed without indenting */
+        lua_rawgeti( L,top + 2,1 );
+        if ( 1 == count && writer_is_text( L,-1 ) >= 0 )
+        {
+            inline_index = top + 3;
+            break;
+        }
+        lua_pop( L,1 );
+
+        /* rapidxml print it childless as <name .../>,reopen it */
+        writer_print( w->out,&node,w->pretty,indent );
+        w->out.resize( w->out.size() - ( w->pretty ? 3 : 2 ) );
+        w->out.push_back( '>' );
+        writer_newline( w );
+
+        writer_frame frame;
+        frame.index  = top + 2;
+        frame.next   = 1;
+        frame.count  = count;
+        frame.indent = indent;
+        w->frames.push_back( frame );
+        return 1;
+    }
+    default:
+        MARK_ERROR( msg,"encode element","unsupport value type" );
+        return -1;
+    }
+
+    /* a value is the node value,but a sole child is a data node even if it's
+     * empty,like encode_element build them
+     */
+    char _buffer[64];
+    rapidxml::xml_node<> data( rapidxml::node_data );
+    if ( inline_index )
+    {
+        size_t val_len = 0;
+        const char *val = writer_text( L,inline_index,_buffer,&val_len );
+        if ( top + 3 == inline_index )
+        {
+            data.value( val,val_len );
+            node.append_node( &data );
+        }
+        else
+        {
+            node.value( val,val_len );
+        }
+    }
+    writer_print( w->out,&node,w->pretty,indent );
+
+    lua_settop( L,top - 1 );
+    return 0;
+}
+
+/* write next node,return 1 if all done,0 if not yet,-1 if error */
+int writer_step( lua_State *L,xml_writer *w,char *msg )
+{
+    if ( !w->started )
+    {
+        w->started = 1;
+        writer_declaration( w->out,w->pretty );
+
+        lua_pushvalue( L,w->root );
+        if ( writer_element( L,w,lua_gettop( L ),0,msg ) < 0 ) return -1;
+    }
+    else
+    {
+        writer_frame &frame = w->frames.back();
+        if ( frame.next > frame.count ) /* close element */
+        {
+            size_t name_len = 0;
+            const char *name = lua_tolstring( L,frame.index - 1,&name_len );
+
+            /* the end tag as rapidxml print_element_node do */
+            if ( w->pretty ) w->out.append( frame.indent,'\t' );
+            w->out.append( "</",2 );
+            w->out.append( name,name_len );
+            w->out.push_back( '>' );
+            writer_newline( w );
+
+            lua_settop( L,frame.index - 3 );
+            w->frames.pop_back();
+        }
+        else
+        {
+            int indent = frame.indent + 1;
+            lua_rawgeti( L,frame.index,frame.next++ );
+            switch ( lua_type( L,-1 ) )
+            {
+            case LUA_TUSERDATA :
+            case LUA_TNUMBER :
+            case LUA_TSTRING :
+            {
+                if ( writer_is_text( L,-1 ) < 0 ) /* not a slice */
+                {
+                    MARK_ERROR( msg,
+                        "encode node","node must be number,string or table" );
+                    return -1;
+                }
+                char _buffer[64];
+                size_t val_len = 0;
+                const char *val = writer_text( L,-1,_buffer,&val_len );
+
+                rapidxml::xml_node<> data( rapidxml::node_data );
+                data.value( val,val_len );
+                writer_print( w->out,&data,w->pretty,indent );
+                lua_pop( L,1 );
+                break;
+            }
+            case LUA_TTABLE :
+                if ( writer_element( L,w,lua_gettop( L ),indent,msg ) < 0 )
+                {
+                    return -1;
+                }
+                break;
+            default :
+                MARK_ERROR( msg,
+                    "encode node","node must be number,string or table" );
+                return -1;
+            }
+        }
+    }
+
+    if ( !w->frames.empty() ) return 0;
+
+    /* rapidxml print a line break after document node */
+    writer_newline( w );
+    w->done = 1;
+    return 1;
+}
+
+/* ============================ time-sliced encode ========================== */
+/* encode( tb,{ pretty = true,yield_nodes = 1024,yield_bytes = 65536 } )
+ * encode_to_file( tb,file,{ ... } )
+ * write at most yield_nodes nodes or yield_bytes bytes,then yield to the
+ * calling coroutine.encode_to_file write every slice to file before yield.
+ * with chunk = true,encode yield the chunk of every slice and return the last
+ * one,instead of returning the whole string
+ */
+#define ENCODE_STATE_MT "lua_rapidxml.encode_state"
+#define ENCODE_FLUSH    (64*1024) /* flush to file when not yieldable */
+
+struct encode_state
+{
+    xml_writer w;
+    std::ofstream file;
+    int to_file;
+    int chunk;
+    int nodes;
+    size_t bytes;
+    int top; /* lua stack top after last slice */
+};
+
+int encode_state_gc( lua_State *L )
+{
+    encode_state *es = (encode_state *)lua_rapidxml_gc_udata( L,ENCODE_STATE_MT );
+    if ( !es ) return 0;
+
+    es->~encode_state();
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+/* run one slice,return 1 if finish,0 if budget used up,-1 if error */
+int encode_slice_run( lua_State *L,encode_state *es,int yieldable,char *msg )
+{
+    int return_code = 0;
+    try
+    {
+        int nodes = 0;
+        size_t begin = es->w.out.size();
+        do
+        {
+            return_code = writer_step( L,&es->w,msg );
+
+            if ( es->to_file && ( 0 != return_code
+                || ( !yieldable && es->w.out.size() >= ENCODE_FLUSH ) ) )
+            {
+                es->file.write( es->w.out.c_str(),es->w.out.size() );
+                es->w.out.clear();
+                begin = 0;
+            }
+            if ( 0 != return_code || !yieldable ) continue;
+
+            ++nodes;
+            if ( es->nodes > 0 && nodes >= es->nodes ) break;
+            if ( es->bytes > 0 && es->w.out.size() - begin >= es->bytes ) break;
+        } while ( 0 == return_code );
+
+        if ( es->to_file && 0 == return_code )
+        {
+            es->file.write( es->w.out.c_str(),es->w.out.size() );
+            es->w.out.clear();
+        }
+        if ( es->to_file && 1 == return_code ) es->file.close();
+    }
+    catch( const std::bad_alloc &e )
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"memory allocate fail",e.what() );
+    }
+    catch (const std::ifstream::failure &e)
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"write to file fail",e.what() );
+    }
+    catch ( ... )
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"encode","unknow error" );
+    }
+
+    return return_code;
+}
+
+#if LUA_VERSION_NUM >= 503
+int encode_slice_k( lua_State *L,int status,lua_KContext ctx );
+#elif LUA_VERSION_NUM == 502
+int encode_slice_k( lua_State *L );
+#endif
+
+/* the userdata state is at index 4,open elements above it */
+int encode_slice( lua_State *L )
+{
+    encode_state *es = (encode_state *)lua_touserdata( L,4 );
+
+    /* drop what was passed by resume */
+    if ( es->top > 0 ) lua_settop( L,es->top );
+
+    char msg[MAX_MSG_LEN] = { 0 };
+    int yieldable = lua_rapidxml_yieldable( L );
+    int return_code = encode_slice_run( L,es,yieldable,msg );
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    if ( 1 == return_code )
+    {
+        if ( es->to_file )
+        {
+            lua_pushboolean( L,1 );
+        }
+        else
+        {
+            lua_pushlstring( L,es->w.out.c_str(),es->w.out.size() );
+        }
+        return 1;
+    }
+
+    es->top = lua_gettop( L );
+#if LUA_VERSION_NUM >= 502
+    if ( es->chunk )
+    {
+        lua_pushlstring( L,es->w.out.c_str(),es->w.out.size() );
+        es->w.out.clear();
+        return lua_yieldk( L,1,0,encode_slice_k );
+    }
+    return lua_yieldk( L,0,0,encode_slice_k );
+#else
+    return 0;
+#endif
+}
+
+#if LUA_VERSION_NUM >= 503
+int encode_slice_k( lua_State *L,int status,lua_KContext ctx )
+{
+    (void)status;
+    (void)ctx;
+    return encode_slice( L );
+}
+#elif LUA_VERSION_NUM == 502
+int encode_slice_k( lua_State *L )
+{
+    return encode_slice( L );
+}
+#endif
+
+/* options at index 3,and the file path at index 2 if write to file */
+int encode_sliced( lua_State *L,int to_file )
+{
+    lua_getfield( L,3,"pretty" );
+    lua_getfield( L,3,"yield_nodes" );
+    lua_getfield( L,3,"yield_bytes" );
+    lua_getfield( L,3,"chunk" );
+    int pretty   = lua_toboolean( L,-4 );
+    int nodes    = (int)lua_tointeger( L,-3 );
+    lua_Integer bytes = lua_tointeger( L,-2 );
+    int chunk    = lua_toboolean( L,-1 );
+    lua_settop( L,3 );
+
+    encode_state *es = (encode_state *)lua_newuserdata( L,sizeof(encode_state) );
+    new (es) encode_state();
+    luaL_getmetatable( L,ENCODE_STATE_MT );
+    lua_setmetatable( L,-2 );
+
+    writer_init( &es->w,1,pretty,extra_keys_option( L,3 ) );
+    es->to_file = to_file;
+    es->chunk   = !to_file && chunk;
+    es->nodes   = nodes;
+    es->bytes   = bytes > 0 ? (size_t)bytes : 0;
+    es->top     = 0;
+
+    if ( to_file )
+    {
+        int return_code = 0;
+        char msg[MAX_MSG_LEN] = { 0 };
+        try
+        {
+            es->file.exceptions( std::ifstream::failbit | std::ifstream::badbit );
+            es->file.open( lua_tostring( L,2 ),
+                std::ofstream::out|std::ofstream::trunc );
+        }
+        catch (const std::ifstream::failure &e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"write to file fail",e.what() );
+        }
+
+        if ( return_code < 0 )
+        {
+            lua_rapidxml_error( L,msg );
+            return 0;
+        }
+    }
+
+    return encode_slice( L );
+}
+
+/* ============================ print size ================================== */
+/* the exact length of rapidxml::print output,so the string can be allocated
+ * once.encode( tb,{ presize = true } ) turn it on
+ */
+size_t print_expand_size( const char *str,size_t len,char noexpand )
+{
+    size_t size = len;
+    for ( const char *p = str;p < str + len; ++p )
+    {
+        if ( noexpand == *p ) continue;
+        switch ( *p )
+        {
+        case '<'  :
+        case '>'  : size += 3; break; /* &lt; &gt; */
+        case '&'  : size += 4; break; /* &amp; */
+        case '\'' :
+        case '"'  : size += 5; break; /* &apos; &quot; */
+        }
+    }
+    return size;
+}
+
+size_t print_size( const rapidxml::xml_node<> *node,int pretty,int indent )
+{
+    size_t size = 0;
+    switch ( node->type() )
+    {
+    case rapidxml::node_document :
+    {
+        for ( rapidxml::xml_node<> *child = node->first_node();
+            child; child = child->next_sibling() )
+        {
+            size += print_size( child,pretty,indent );
+        }
+    }break;
+    case rapidxml::node_element :
+    {
+        size += ( pretty ? indent : 0 ) + 1 + node->name_size();
+        for ( rapidxml::xml_attribute<> *attr = node->first_attribute();
+            attr; attr = attr->next_attribute() )
+        {
+            const char *val = attr->value();
+            size_t val_len  = attr->value_size();
+            char noexpand   = memchr( val,'"',val_len ) ? '"' : '\'';
+            size += 4 + attr->name_size()
+                + print_expand_size( val,val_len,noexpand ); /* ' name=""' */
+        }
+
+        rapidxml::xml_node<> *child = node->first_node();
+        if ( 0 == node->value_size() && !child )
+        {
+            size += 2; /* /> */
+            break;
+        }
+
+        size += 1 + 3 + node->name_size(); /* > and </name> */
+        if ( !child )
+        {
+            size += print_expand_size( node->value(),node->value_size(),0 );
+        }
+        else if ( !child->next_sibling()
+            && rapidxml::node_data == child->type() )
+        {
+            size += print_expand_size( child->value(),child->value_size(),0 );
+        }
+        else
+        {
+            if ( pretty ) size += 1 + indent;
+            for ( ;child; child = child->next_sibling() )
+            {
+                size += print_size( child,pretty,indent + 1 );
+            }
+        }
+    }break;
+    case rapidxml::node_data :
+        size += ( pretty ? indent : 0 )
+            + print_expand_size( node->value(),node->value_size(),0 );
+        break;
+    case rapidxml::node_cdata :
+        size += ( pretty ? indent : 0 ) + 12 + node->value_size();
+        break;
+    case rapidxml::node_pi :
+        size += ( pretty ? indent : 0 ) + 5 + node->name_size()
+            + node->value_size(); /* <?name value?> */
+        break;
+    default : assert( false ); break;
+    }
+
+    /* a line break after every node */
+    if ( pretty ) size += 1;
+
+    return size;
+}
+
+/* output iterator of rapidxml::print into [ptr,end).a char past end is only
+ * counted,so a wrong size never overflow the slab
+ */
+struct print_slab
+{
+    char *ptr;
+    char *end;
+    size_t over;
+};
+
+struct print_bound_iterator
+{
+    print_slab *slab;
+
+    print_bound_iterator &operator*() { return *this; }
+    print_bound_iterator &operator++() { return *this; }
+    print_bound_iterator &operator++( int ) { return *this; }
+    print_bound_iterator &operator=( char c )
+    {
+        if ( slab->ptr < slab->end ) *slab->ptr++ = c;
+        else ++slab->over;
+
+        return *this;
+    }
+};
+
+/* print doc into a buffer of exact print_size,so it never grow.lua has no
+ * api to adopt the bytes,luaL_pushresultsize still copy them into the string.
+ * return -1 with nothing pushed if the size is too small
+ */
+int print_presized( lua_State *L,const rapidxml::xml_node<> &doc,int pretty,int flags )
+{
+    size_t size = print_size( &doc,pretty,0 );
+#if LUA_VERSION_NUM >= 502
+    luaL_Buffer b;
+    char *ptr = luaL_buffinitsize( L,&b,size );
+#else
+    std::string str( size,'\0' );
+    char *ptr = &str[0];
+#endif
+
+    print_slab slab = { ptr,ptr + size,0 };
+    print_bound_iterator out = { &slab };
+    rapidxml::print( out,doc,flags );
+
+#if LUA_VERSION_NUM >= 502
+    luaL_pushresultsize( &b,slab.ptr - ptr );
+    if ( slab.over > 0 )
+    {
+        lua_pop( L,1 );
+        return -1;
+    }
+#else
+    if ( slab.over > 0 ) return -1;
+    lua_pushlstring( L,ptr,slab.ptr - ptr );
+#endif
+
+    return 0;
+}
+
+/* encode( tb,pretty ) or encode( tb,opts ),opts at index,return -1 if it's
+ * not a sliced encode and set pretty
+ */
+int encode_option( lua_State *L,int index,int *pretty )
+{
+    if ( !lua_istable( L,index ) )
+    {
+        *pretty = lua_toboolean( L,index );
+        return -1;
+    }
+
+    lua_getfield( L,index,"yield_nodes" );
+    lua_getfield( L,index,"yield_bytes" );
+    int sliced = lua_tointeger( L,-2 ) > 0 || lua_tointeger( L,-1 ) > 0;
+    lua_pop( L,2 );
+
+    if ( sliced ) return 1;
+
+    lua_getfield( L,index,"pretty" );
+    *pretty = lua_toboolean( L,-1 );
+    lua_pop( L,1 );
+
+    return -1;
+}
+
+int encode( lua_State *L )
+{
+    if ( !lua_istable( L,1) )
+    {
+        return luaL_error( L,"argument #1 table expect" );
+    }
+
+    int pretty = 0;
+    if ( encode_option( L,2,&pretty ) > 0 )
+    {
+        lua_settop( L,2 );
+        lua_pushnil( L );
+        lua_insert( L,2 ); /* options at index 3 */
+        return encode_sliced( L,0 );
+    }
+
+    int presize = 0;
+    if ( lua_istable( L,2 ) )
+    {
+        lua_getfield( L,2,"presize" );
+        presize = lua_toboolean( L,-1 );
+        lua_pop( L,1 );
+    }
+    int ignore_extra = extra_keys_option( L,2 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+
+    {
+        rapidxml::xml_document<> doc;
+        try
+        {
+            /* document type */
+            rapidxml::xml_node<>* dt = doc.allocate_node( rapidxml::node_pi,
+                doc.allocate_string( XML_PI ) );
+            doc.append_node( dt );
+
+            rapidxml::xml_node<> *root =
+                encode_element( L,1,&doc,ignore_extra,msg );
+            if ( !root )
+            {
+                return_code = -1;
+            }
+            else
+            {
+                doc.append_node( root );
+
+                int flags = pretty ? 0 : rapidxml::print_no_indenting;
+
+                /* print into a slab of exact size,no reallocation.fall
+                 * back to a growing string if the size is wrong
+                 */
+                if ( !presize || print_presized( L,doc,pretty,flags ) < 0 )
+                {
+                    std::string str;
+                    rapidxml::print( std::back_inserter(str),doc,flags );
+                    lua_pushstring( L,str.c_str() );
+                }
+            }
+        }
+        catch( const std::bad_alloc &e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"memory allocate fail",e.what() );
+        }
+        catch ( ... )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"encode","unknow error" );
+        }
+
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+int encode_to_file( lua_State *L )
+{
+    if ( !lua_istable( L,1) )
+    {
+        return luaL_error( L,"argument #1 table expect" );
+    }
+
+    const char *path = luaL_checkstring( L,2 );
+    int pretty = 0;
+    if ( encode_option( L,3,&pretty ) > 0 )
+    {
+        lua_settop( L,3 );
+        return encode_sliced( L,1 );
+    }
+    int ignore_extra = extra_keys_option( L,3 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+
+    {
+        rapidxml::xml_document<> doc;
+        try
+        {
+            /* document type */
+            rapidxml::xml_node<> *dt = doc.allocate_node( rapidxml::node_pi,
+                doc.allocate_string( XML_PI ) );
+            doc.append_node( dt );
+
+            rapidxml::xml_node<> *root =
+                encode_element( L,1,&doc,ignore_extra,msg );
+            if ( !root )
+            {
+                return_code = -1;
+            }
+            else  /* write to file */
+            {
+                doc.append_node( root );
+                std::ofstream out;
+                out.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+                out.open( path,std::ofstream::out|std::ofstream::trunc );
+
+                assert( out.good() );
+                rapidxml::print( std::ostream_iterator<char>(out),doc,
+                    pretty ? 0 : rapidxml::print_no_indenting );
+                out.close();
+            }
+        }
+        catch( const std::bad_alloc &e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"memory allocate fail",e.what() );
+        }
+        catch (const std::ifstream::failure &e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"write to file fail",e.what() );
+        }
+        catch ( ... )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"encode_to_file","unknow error" );
+        }
+
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    lua_pushboolean( L,1 );
+    return 1;
+}
+
+/* ============================ stream encode =============================== */
+/* encode_stream( tb,sink,{ pretty = true,chunk_size = 16384 } )
+ * sink is a function called as sink( chunk ),or a file descriptor.the text is
+ * handed out every chunk_size bytes,so only one chunk is kept in memory
+ */
+#define STREAM_CHUNK (16*1024)
+
+/* hand out the text in writer,sink at index 2 */
+int encode_stream_flush( lua_State *L,xml_writer *w,char *msg )
+{
+    if ( w->out.empty() ) return 0;
+
+    if ( LUA_TNUMBER == lua_type( L,2 ) )
+    {
+        int fd = (int)lua_tointeger( L,2 );
+        const char *buffer = w->out.c_str();
+        size_t size = w->out.size();
+        while ( size > 0 )
+        {
+            ssize_t len = write( fd,buffer,size );
+            if ( len < 0 )
+            {
+                if ( EINTR == errno ) continue;
+
+                MARK_ERROR( msg,"write to fd fail",strerror( errno ) );
+                return -1;
+            }
+            buffer += len;
+            size   -= (size_t)len;
+        }
+    }
+    else
+    {
+        lua_pushvalue( L,2 );
+        lua_pushlstring( L,w->out.c_str(),w->out.size() );
+        if ( 0 != lua_pcall( L,1,0,0 ) )
+        {
+            MARK_ERROR( msg,"encode_stream sink",lua_rapidxml_errmsg( L,-1 ) );
+            lua_pop( L,1 );
+            return -1;
+        }
+    }
+
+    w->out.clear();
+    return 0;
+}
+
+int encode_stream( lua_State *L )
+{
+    if ( !lua_istable( L,1) )
+    {
+        return luaL_error( L,"argument #1 table expect" );
+    }
+
+    int type = lua_type( L,2 );
+    if ( LUA_TFUNCTION != type && LUA_TNUMBER != type )
+    {
+        return luaL_error( L,"argument #2 function or file descriptor expect" );
+    }
+
+    int pretty = 0;
+    size_t chunk_size = STREAM_CHUNK;
+    if ( lua_istable( L,3 ) )
+    {
+        lua_getfield( L,3,"pretty" );
+        lua_getfield( L,3,"chunk_size" );
+        pretty = lua_toboolean( L,-2 );
+        if ( lua_tointeger( L,-1 ) > 0 ) chunk_size = lua_tointeger( L,-1 );
+        lua_pop( L,2 );
+    }
+    else
+    {
+        pretty = lua_toboolean( L,3 );
+    }
+    lua_settop( L,3 );
+    int ignore_extra = extra_keys_option( L,3 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    lua_Integer bytes = 0;
+
+    {
+        xml_writer w;
+        try
+        {
+            writer_init( &w,1,pretty,ignore_extra );
+            w.out.reserve( chunk_size + 1024 );
+            do
+            {
+                return_code = writer_step( L,&w,msg );
+                if ( return_code < 0 ) break;
+
+                if ( w.out.size() >= chunk_size || 1 == return_code )
+                {
+                    bytes += w.out.size();
+                    if ( encode_stream_flush( L,&w,msg ) < 0 )
+                    {
+                        return_code = -1;
+                    }
+                }
+            } while ( 0 == return_code );
+        }
+        catch( const std::bad_alloc &e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"memory allocate fail",e.what() );
+        }
+        catch ( ... )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"encode_stream","unknow error" );
+        }
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    lua_pushinteger( L,bytes );
+    return 1;
+}
+
+/* ============================ reusable buffer ============================= */
+/* local buf = xml.buffer( capacity )
+ * local len = xml.encode_into( tb,buf,{ pretty = true } )
+ * the buffer keep it's capacity(and the writer's frame stack) between calls,
+ * so encoding a similar document again allocate nothing.buf:write( fd ) send
+ * the bytes without making a lua string
+ */
+#define BUFFER_MT "lua_rapidxml.buffer"
+
+struct xml_buffer
+{
+    xml_writer w; /* w.out is the bytes */
+};
+
+xml_buffer *buffer_check( lua_State *L,int index )
+{
+    return (xml_buffer *)luaL_checkudata( L,index,BUFFER_MT );
+}
+
+/* if the userdata at index is a buffer,return 1 and the bytes in it */
+int buffer_view( lua_State *L,int index,const char **ptr,size_t *size )
+{
+    if ( slice_view( L,index,ptr,size ) ) return 1;
+    if ( !lua_getmetatable( L,index ) ) return 0;
+
+    luaL_getmetatable( L,BUFFER_MT );
+    int is_buffer = lua_rawequal( L,-1,-2 );
+    lua_pop( L,2 );
+    if ( !is_buffer ) return 0;
+
+    xml_buffer *buf = (xml_buffer *)lua_touserdata( L,index );
+    *ptr  = buf->w.out.c_str();
+    *size = buf->w.out.size();
+    return 1;
+}
+
+int buffer( lua_State *L )
+{
+    lua_Integer capacity = luaL_optinteger( L,1,0 );
+
+    xml_buffer *buf = (xml_buffer *)lua_newuserdata( L,sizeof(xml_buffer) );
+    new (buf) xml_buffer();
+    luaL_getmetatable( L,BUFFER_MT );
+    lua_setmetatable( L,-2 );
+
+    if ( capacity > 0 )
+    {
+        int return_code = 0;
+        char msg[MAX_MSG_LEN] = { 0 };
+        try
+        {
+            buf->w.out.reserve( (size_t)capacity );
+        }
+        catch( const std::exception &e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"memory allocate fail",e.what() );
+        }
+
+        if ( return_code < 0 )
+        {
+            lua_rapidxml_error( L,msg );
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int buffer_len( lua_State *L )
+{
+    xml_buffer *buf = buffer_check( L,1 );
+    lua_pushinteger( L,(lua_Integer)buf->w.out.size() );
+
+    return 1;
+}
+
+int buffer_capacity( lua_State *L )
+{
+    xml_buffer *buf = buffer_check( L,1 );
+    lua_pushinteger( L,(lua_Integer)buf->w.out.capacity() );
+
+    return 1;
+}
+
+int buffer_tostring( lua_State *L )
+{
+    xml_buffer *buf = buffer_check( L,1 );
+    lua_pushlstring( L,buf->w.out.c_str(),buf->w.out.size() );
+
+    return 1;
+}
+
+/* pointer and length,valid until next encode_into or clear */
+int buffer_data( lua_State *L )
+{
+    xml_buffer *buf = buffer_check( L,1 );
+    lua_pushlightuserdata( L,(void *)buf->w.out.c_str() );
+    lua_pushinteger( L,(lua_Integer)buf->w.out.size() );
+
+    return 2;
+}
+
+int buffer_clear( lua_State *L )
+{
+    xml_buffer *buf = buffer_check( L,1 );
+    buf->w.out.clear();
+
+    return 0;
+}
+
+/* write all to fd,return bytes written,or nil,error,bytes written */
+int write_fd( lua_State *L,int fd,const char *ptr,size_t size )
+{
+    size_t written = 0;
+    while ( written < size )
+    {
+        ssize_t len = write( fd,ptr + written,size - written );
+        if ( len < 0 )
+        {
+            if ( EINTR == errno ) continue;
+
+            lua_pushnil( L );
+            lua_pushstring( L,strerror( errno ) );
+            lua_pushinteger( L,(lua_Integer)written );
+            return 3;
+        }
+        written += (size_t)len;
+    }
+
+    lua_pushinteger( L,(lua_Integer)written );
+    return 1;
+}
+
+/* buf:write( fd,offset ),write bytes from offset(0 based) to fd.return the
+ * bytes written,or nil,error,bytes written if fail(e.g. EAGAIN)
+ */
+int buffer_write( lua_State *L )
+{
+    xml_buffer *buf = buffer_check( L,1 );
+    int fd = (int)luaL_checkinteger( L,2 );
+    lua_Integer offset = luaL_optinteger( L,3,0 );
+    if ( offset < 0 || (size_t)offset > buf->w.out.size() )
+    {
+        return luaL_error( L,"buffer offset out of range" );
+    }
+
+    const char *ptr = buf->w.out.c_str() + offset;
+    size_t size = buf->w.out.size() - (size_t)offset;
+    return write_fd( L,fd,ptr,size );
+}
+
+int buffer_gc( lua_State *L )
+{
+    xml_buffer *buf = (xml_buffer *)lua_rapidxml_gc_udata( L,BUFFER_MT );
+    if ( !buf ) return 0;
+
+    buf->~xml_buffer();
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+int encode_into( lua_State *L )
+{
+    if ( !lua_istable( L,1) )
+    {
+        return luaL_error( L,"argument #1 table expect" );
+    }
+
+    xml_buffer *buf = buffer_check( L,2 );
+
+    int pretty = 0;
+    if ( lua_istable( L,3 ) )
+    {
+        lua_getfield( L,3,"pretty" );
+        pretty = lua_toboolean( L,-1 );
+        lua_pop( L,1 );
+    }
+    else
+    {
+        pretty = lua_toboolean( L,3 );
+    }
+    lua_settop( L,3 );
+    int ignore_extra = extra_keys_option( L,3 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    try
+    {
+        writer_init( &buf->w,1,pretty,ignore_extra );
+        do
+        {
+            return_code = writer_step( L,&buf->w,msg );
+        } while ( 0 == return_code );
+    }
+    catch( const std::bad_alloc &e )
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"memory allocate fail",e.what() );
+    }
+    catch ( ... )
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"encode_into","unknow error" );
+    }
+
+    if ( return_code < 0 )
+    {
+        buf->w.out.clear();
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    lua_settop( L,3 );
+    lua_pushinteger( L,(lua_Integer)buf->w.out.size() );
+    return 1;
+}
+
+/* ============================ template ==================================== */
+/* local tpl = xml.template( '<msg id="${id}"><body>${text}</body></msg>' )
+ * local str = tpl:render( { id = 1,text = "hello" } )
+ * local len = tpl:render( values,buf )
+ * the template is split into static segments and slots once.a slot in text
+ * is escaped like data,a slot in a attribute value is escaped for it's quote.
+ * placeholders anywhere else(names,comments,cdata...) are rejected
+ */
+#define TEMPLATE_MT "lua_rapidxml.template"
+
+enum
+{
+    TPL_TEXT    = 0,
+    TPL_TAG     = 1,
+    TPL_DQUOTE  = 2, /* attribute value in "" */
+    TPL_SQUOTE  = 3, /* attribute value in '' */
+    TPL_MARKUP  = 4  /* comment,cdata,pi,doctype */
+};
+
+struct template_slot
+{
+    size_t begin;    /* static segment before slot */
+    size_t len;
+    std::string name;
+    char noexpand;   /* quote not need to escape,0 for text */
+};
+
+struct xml_template
+{
+    std::string text;
+    std::vector<template_slot> slots;
+    size_t tail;     /* static segment after last slot */
+    std::string out; /* reused by render */
+};
+
+/* end of a markup which is not a tag,or NULL */
+const char *template_markup_end( const char *p,const char *end )
+{
+    const char *close = "?>";
+    if ( end - p >= 4 && 0 == memcmp( p,"<!--",4 ) ) close = "-->";
+    else if ( end - p >= 9 && 0 == memcmp( p,"<![CDATA[",9 ) ) close = "]]>";
+    else if ( end - p >= 2 && '!' == p[1] ) close = ">";
+    else if ( end - p < 2 || '?' != p[1] ) return NULL;
+
+    size_t close_len = strlen( close );
+    for ( const char *q = p + 2;q + close_len <= end; ++q )
+    {
+        if ( 0 == memcmp( q,close,close_len ) ) return q + close_len;
+    }
+    return end;
+}
+
+int template_compile( xml_template *tpl,const char *str,size_t len,char *msg )
+{
+    tpl->text.assign( str,len );
+    tpl->slots.clear();
+
+    const char *begin = tpl->text.c_str();
+    const char *end   = begin + len;
+    const char *last  = begin; /* start of current static segment */
+    int state = TPL_TEXT;
+    for ( const char *p = begin;p < end; )
+    {
+        if ( '$' == *p && p + 1 < end && '{' == p[1] )
+        {
+            const char *close = (const char *)memchr( p,'}',end - p );
+            if ( !close || close == p + 2 )
+            {
+                MARK_ERROR( msg,"template","invalid placeholder" );
+                return -1;
+            }
+            if ( TPL_TEXT != state
+                && TPL_DQUOTE != state && TPL_SQUOTE != state )
+            {
+                MARK_ERROR( msg,"template",
+                    "placeholder must be in text or attribute value" );
+                return -1;
+            }
+
+            template_slot slot;
+            slot.begin    = last - begin;
+            slot.len      = p - last;
+            slot.name.assign( p + 2,close - p - 2 );
+            slot.noexpand = TPL_DQUOTE == state ? '\''
+                : ( TPL_SQUOTE == state ? '"' : 0 );
+            tpl->slots.push_back( slot );
+
+            p = last = close + 1;
+            continue;
+        }
+
+        switch ( state )
+        {
+        case TPL_TEXT :
+            if ( '<' == *p )
+            {
+                const char *markup_end = template_markup_end( p,end );
+                if ( markup_end )
+                {
+                    /* a placeholder inside is not replaced,reject it */
+                    for ( const char *q = p;q + 1 < markup_end; ++q )
+                    {
+                        if ( '$' != q[0] || '{' != q[1] ) continue;
+
+                        MARK_ERROR( msg,"template",
+                            "placeholder must be in text or attribute value" );
+                        return -1;
+                    }
+                    p = markup_end;
+                    continue;
+                }
+                state = TPL_TAG;
+            }
+            break;
+        case TPL_TAG :
+            if ( '>' == *p ) state = TPL_TEXT;
+            else if ( '"' == *p ) state = TPL_DQUOTE;
+            else if ( '\'' == *p ) state = TPL_SQUOTE;
+            break;
+        case TPL_DQUOTE : if ( '"' == *p ) state = TPL_TAG; break;
+        case TPL_SQUOTE : if ( '\'' == *p ) state = TPL_TAG; break;
+        }
+        ++p;
+    }
+
+    tpl->tail = last - begin;
+    return 0;
+}
+
+int template_gc( lua_State *L )
+{
+    xml_template *tpl = (xml_template *)lua_rapidxml_gc_udata( L,TEMPLATE_MT );
+    if ( !tpl ) return 0;
+
+    tpl->~xml_template();
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+int xml_template_new( lua_State *L )
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+
+    xml_template *tpl =
+        (xml_template *)lua_newuserdata( L,sizeof(xml_template) );
+    new (tpl) xml_template();
+    luaL_getmetatable( L,TEMPLATE_MT );
+    lua_setmetatable( L,-2 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    try
+    {
+        return_code = template_compile( tpl,str,len,msg );
+    }
+    catch( const std::bad_alloc &e )
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"memory allocate fail",e.what() );
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* fill slots with values at index 2 into out */
+int template_fill( lua_State *L,xml_template *tpl,std::string &out,char *msg )
+{
+    const char *text = tpl->text.c_str();
+    for ( std::vector<template_slot>::const_iterator itr = tpl->slots.begin();
+        itr != tpl->slots.end(); ++itr )
+    {
+        out.append( text + itr->begin,itr->len );
+
+        lua_getfield( L,2,itr->name.c_str() );
+        switch ( lua_type( L,-1 ) )
+        {
+        case LUA_TNUMBER :
+        {
+            char _buffer[64];
+            size_t val_len = encode_number( lua_tonumber( L,-1 ),_buffer );
+            out.append( _buffer,val_len );
+        }break;
+        case LUA_TSTRING :
+        {
+            size_t val_len = 0;
+            const char *val = lua_tolstring( L,-1,&val_len );
+            writer_escape( out,val,val_len,itr->noexpand );
+        }break;
+        default :
+            snprintf( msg,MAX_MSG_LEN,
+                "template:value of ${%s} must be number or string",
+                itr->name.c_str() );
+            return -1;
+        }
+        lua_pop( L,1 );
+    }
+    out.append( text + tpl->tail,tpl->text.size() - tpl->tail );
+
+    return 0;
+}
+
+int template_render( lua_State *L )
+{
+    xml_template *tpl = (xml_template *)luaL_checkudata( L,1,TEMPLATE_MT );
+    luaL_checktype( L,2,LUA_TTABLE );
+
+    xml_buffer *buf = lua_isnoneornil( L,3 ) ? NULL : buffer_check( L,3 );
+    std::string &out = buf ? buf->w.out : tpl->out;
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    try
+    {
+        out.clear();
+        return_code = template_fill( L,tpl,out,msg );
+    }
+    catch( const std::bad_alloc &e )
+    {
+        return_code = -1;
+        MARK_ERROR( msg,"memory allocate fail",e.what() );
+    }
+
+    if ( return_code < 0 )
+    {
+        out.clear();
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    if ( buf )
+    {
+        lua_pushinteger( L,(lua_Integer)out.size() );
+    }
+    else
+    {
+        lua_pushlstring( L,out.c_str(),out.size() );
+    }
+    return 1;
+}
+
+/* ============================ patch ======================================= */
+/* xml.patch( str,{ ["root/item[2]/name"] = "new text",
+ *                  ["root/item[2]@id"] = 3,
+ *                  ["root/old"] = false } )
+ * "a/b" replace the content of element b,"a/b@x" set attribute x,false
+ * remove the element or attribute."[n]" select the n-th sibling with that
+ * name,without it every match is changed,"*" match any name.a edit inside a
+ * element which another edit replace or remove,or two edits of the same
+ * attribute,is a error.the source is scanned once,and copied verbatim around
+ * the changed spans,so formatting and comments are kept.return the new string
+ * and the number of changes
+ */
+struct patch_seg
+{
+    std::string name;
+    int index; /* 0 means any */
+};
+
+struct patch_edit
+{
+    std::vector<patch_seg> segs;
+    std::string attr;   /* empty if change the content */
+    std::string value;
+    int remove;
+};
+
+struct patch_splice
+{
+    size_t begin; /* replace [begin,end) of source with text */
+    size_t end;
+    std::string text;
+
+    bool operator < ( const patch_splice &other ) const
+    {
+        if ( begin != other.begin ) return begin < other.begin;
+        return end < other.end;
+    }
+};
+
+struct patch_count
+{
+    const char *name;
+    size_t name_len;
+    int count;
+};
+
+struct patch_level
+{
+    const char *name;
+    size_t name_len;
+    int index;                        /* 1 based index among same name */
+    std::vector<patch_count> counts;  /* children count by name */
+};
+
+struct patch_ctx
+{
+    std::vector<patch_edit> edits;
+    std::vector<patch_level> levels;  /* reused,valid up to depth */
+    size_t depth;
+    std::vector<patch_splice> splices;
+    const char *str;
+    int changes;
+};
+
+int patch_parse_path( const char *path,size_t len,patch_edit &edit,char *msg )
+{
+    const char *end = path + len;
+    const char *at  = (const char *)memchr( path,'@',len );
+    if ( at )
+    {
+        edit.attr.assign( at + 1,end - at - 1 );
+        end = at;
+        if ( edit.attr.empty() )
+        {
+            MARK_ERROR( msg,"patch","empty attribute name in path" );
+            return -1;
+        }
+    }
+
+    while ( path < end )
+    {
+        const char *slash = (const char *)memchr( path,'/',end - path );
+        if ( !slash ) slash = end;
+
+        if ( slash > path )
+        {
+            patch_seg seg;
+            seg.index = 0;
+
+            const char *bracket = (const char *)memchr( path,'[',slash - path );
+            if ( bracket )
+            {
+                /* only digits between [ and ] */
+                char *num_end = NULL;
+                long index = strtol( bracket + 1,&num_end,10 );
+                if ( !isdigit( (unsigned char)bracket[1] ) || index <= 0
+                    || index > INT_MAX || ']' != slash[-1] || num_end != slash - 1 )
+                {
+                    MARK_ERROR( msg,"patch","invalid index in path" );
+                    return -1;
+                }
+                seg.index = (int)index;
+            }
+            seg.name.assign( path,( bracket ? bracket : slash ) - path );
+            edit.segs.push_back( seg );
+        }
+        path = slash + 1;
+    }
+
+    if ( edit.segs.empty() )
+    {
+        MARK_ERROR( msg,"patch","empty path" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* edits table at index */
+int patch_read_edits( lua_State *L,int index,patch_ctx *ctx,char *msg )
+{
+    lua_pushnil( L );
+    while ( 0 != lua_next( L,index ) )
+    {
+        if ( LUA_TSTRING != lua_type( L,-2 ) )
+        {
+            MARK_ERROR( msg,"patch","edit path must be string" );
+            return -1;
+        }
+
+        ctx->edits.push_back( patch_edit() );
+        patch_edit &edit = ctx->edits.back();
+        edit.remove = 0;
+
+        size_t path_len = 0;
+        const char *path = lua_tolstring( L,-2,&path_len );
+        if ( patch_parse_path( path,path_len,edit,msg ) < 0 ) return -1;
+
+        switch ( lua_type( L,-1 ) )
+        {
+        case LUA_TNUMBER :
+        {
+            char _buffer[64];
+            size_t val_len = encode_number( lua_tonumber( L,-1 ),_buffer );
+            edit.value.assign( _buffer,val_len );
+        }break;
+        case LUA_TSTRING :
+        {
+            size_t val_len = 0;
+            const char *val = lua_tolstring( L,-1,&val_len );
+            edit.value.assign( val,val_len );
+        }break;
+        case LUA_TBOOLEAN :
+            if ( !lua_toboolean( L,-1 ) )
+            {
+                edit.remove = 1;
+                break;
+            }
+            /* fall through */
+        default :
+            MARK_ERROR( msg,"patch","edit value must be string,number or false" );
+            return -1;
+        }
+
+        lua_pop( L,1 );
+    }
+
+    return 0;
+}
+
+/* index of a new child named name under current level */
+int patch_child_index( patch_level &parent,const char *name,size_t name_len )
+{
+    for ( std::vector<patch_count>::iterator itr = parent.counts.begin();
+        itr != parent.counts.end(); ++itr )
+    {
+        if ( itr->name_len == name_len && 0 == memcmp( itr->name,name,name_len ) )
+        {
+            return ++itr->count;
+        }
+    }
+
+    patch_count count = { name,name_len,1 };
+    parent.counts.push_back( count );
+    return 1;
+}
+
+void patch_push_level( patch_ctx *ctx,const xml_token &tk )
+{
+    int index = 1;
+    if ( ctx->depth > 0 )
+    {
+        index = patch_child_index(
+            ctx->levels[ctx->depth - 1],tk.name,tk.name_len );
+    }
+
+    if ( ctx->levels.size() <= ctx->depth ) ctx->levels.resize( ctx->depth + 1 );
+    patch_level &level = ctx->levels[ctx->depth++];
+    level.name     = tk.name;
+    level.name_len = tk.name_len;
+    level.index    = index;
+    level.counts.clear();
+}
+
+/* 1 if edit's element path is the current element,0 if it may be a
+ * descendant,-1 if not match
+ */
+int patch_match( patch_ctx *ctx,const patch_edit &edit )
+{
+    if ( edit.segs.size() < ctx->depth ) return -1;
+
+    for ( size_t i = 0;i < ctx->depth; ++i )
+    {
+        const patch_seg &seg = edit.segs[i];
+        const patch_level &level = ctx->levels[i];
+        if ( seg.index && seg.index != level.index ) return -1;
+        if ( seg.name.size() == 1 && '*' == seg.name[0] ) continue;
+        if ( seg.name.size() != level.name_len
+            || 0 != memcmp( seg.name.c_str(),level.name,level.name_len ) )
+        {
+            return -1;
+        }
+    }
+
+    return edit.segs.size() == ctx->depth ? 1 : 0;
+}
+
+void patch_add_splice( patch_ctx *ctx,const char *begin,const char *end )
+{
+    patch_splice splice;
+    splice.begin = begin - ctx->str;
+    splice.end   = end - ctx->str;
+    ctx->splices.push_back( splice );
+    ++ctx->changes;
+}
+
+/* set or remove a attribute in start tag */
+void patch_attribute( patch_ctx *ctx,const xml_token &tk,const patch_edit &edit )
+{
+    const char *prev = tk.name + tk.name_len; /* end of previous item */
+    const char *pos  = tk.attr;
+    const char *name = NULL;
+    const char *value = NULL;
+    size_t name_len = 0;
+    size_t value_len = 0;
+    while ( scan_attribute( &pos,tk.attr_end,&name,&name_len,&value,&value_len ) )
+    {
+        const char *item_end = value + value_len + 1; /* after quote */
+        if ( name_len == edit.attr.size()
+            && 0 == memcmp( name,edit.attr.c_str(),name_len ) )
+        {
+            if ( edit.remove )
+            {
+                patch_add_splice( ctx,prev,item_end );
+                return;
+            }
+
+            char quote = value[-1];
+            patch_add_splice( ctx,value,value + value_len );
+            writer_escape( ctx->splices.back().text,edit.value.c_str(),
+                edit.value.size(),'"' == quote ? '\'' : '"' );
+            return;
+        }
+        prev = item_end;
+    }
+
+    if ( edit.remove ) return; /* nothing to remove */
+
+    patch_add_splice( ctx,prev,prev );
+    std::string &text = ctx->splices.back().text;
+    text.push_back( ' ' );
+    text.append( edit.attr );
+    text.append( "=\"",2 );
+    writer_escape( text,edit.value.c_str(),edit.value.size(),'\'' );
+    text.push_back( '"' );
+}
+
+/* apply edits on a start tag or empty tag,1 if the subtree had been consumed */
+int patch_element( patch_ctx *ctx,xml_scanner *s,xml_token *tk,char *msg )
+{
+    const patch_edit *content = NULL;
+    int descend = 0;
+    int attrs = 0;
+    for ( std::vector<patch_edit>::const_iterator itr = ctx->edits.begin();
+        itr != ctx->edits.end(); ++itr )
+    {
+        int match = patch_match( ctx,*itr );
+        if ( 0 == match ) descend = 1;
+        if ( 1 != match ) continue;
+
+        if ( !itr->attr.empty() )
+        {
+            /* different paths,e.g. root@x and root[1]@x,may hit the same
+             * attribute.their splices could not be ordered
+             */
+            for ( std::vector<patch_edit>::const_iterator prev = ctx->edits.begin();
+                prev != itr; ++prev )
+            {
+                if ( prev->attr == itr->attr && 1 == patch_match( ctx,*prev ) )
+                {
+                    MARK_ERROR( msg,"patch","more than one edit on a attribute" );
+                    return -1;
+                }
+            }
+            patch_attribute( ctx,*tk,*itr );
+            ++attrs;
+            continue;
+        }
+        if ( content )
+        {
+            MARK_ERROR( msg,"patch","more than one content edit on a element" );
+            return -1;
+        }
+        content = &(*itr);
+    }
+
+    /* a edit inside a replaced or removed element would be lost */
+    if ( content && ( descend || ( content->remove && attrs ) ) )
+    {
+        MARK_ERROR( msg,"patch","overlapping edits" );
+        return -1;
+    }
+
+    if ( !content )
+    {
+        if ( descend || XS_EMPTY == tk->type ) return 0;
+
+        /* no edit under this element */
+        if ( XS_ERROR == scan_skip_element( s,tk,1 ) )
+        {
+            MARK_SCAN_ERROR( msg,"invalid xml string",*tk,ctx->str );
+            return -1;
+        }
+        return 1;
+    }
+
+    int type = tk->type;
+    const char *begin = tk->begin;
+    const char *content_begin = tk->end;
+    if ( XS_START == type && XS_ERROR == scan_skip_element( s,tk,1 ) )
+    {
+        MARK_SCAN_ERROR( msg,"invalid xml string",*tk,ctx->str );
+        return -1;
+    }
+
+    if ( content->remove )
+    {
+        patch_add_splice( ctx,begin,tk->end );
+    }
+    else if ( XS_START == type ) /* tk is the end tag now */
+    {
+        patch_add_splice( ctx,content_begin,tk->begin );
+        writer_escape( ctx->splices.back().text,
+            content->value.c_str(),content->value.size(),0 );
+    }
+    else /* <name/> to <name>value</name> */
+    {
+        const patch_level &level = ctx->levels[ctx->depth - 1];
+        patch_add_splice( ctx,tk->end - 2,tk->end );
+        std::string &text = ctx->splices.back().text;
+        text.push_back( '>' );
+        writer_escape( text,content->value.c_str(),content->value.size(),0 );
+        text.append( "</",2 );
+        text.append( level.name,level.name_len );
+        text.push_back( '>' );
+    }
+
+    return 1;
+}
+
+int patch_scan( patch_ctx *ctx,const char *str,size_t len,char *msg )
+{
+    xml_token tk;
+    xml_scanner s;
+
+    scan_init( &s,str,str + len );
+    while ( true )
+    {
+        switch ( scan_token( &s,&tk,1 ) )
+        {
+        case XS_EOF : return 0;
+        case XS_ERROR :
+            MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+            return -1;
+        case XS_TEXT :
+            if ( !tk.blank && 0 == s.depth )
+            {
+                scan_error( &tk,tk.begin,"expected <" );
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+                return -1;
+            }
+            break;
+        case XS_END : --ctx->depth; break;
+        case XS_START :
+        case XS_EMPTY :
+        {
+            patch_push_level( ctx,tk );
+
+            int consumed = patch_element( ctx,&s,&tk,msg );
+            if ( consumed < 0 ) return -1;
+            if ( consumed || XS_EMPTY == tk.type ) --ctx->depth;
+        }break;
+        default : break;
+        }
+    }
+
+    return 0;
+}
+
+/* copy source around the splices */
+int patch_build( patch_ctx *ctx,size_t len,std::string &out,char *msg )
+{
+    std::stable_sort( ctx->splices.begin(),ctx->splices.end() );
+
+    size_t size = len;
+    for ( size_t i = 0;i < ctx->splices.size(); ++i )
+    {
+        const patch_splice &splice = ctx->splices[i];
+        if ( i > 0 && splice.begin < ctx->splices[i - 1].end )
+        {
+            MARK_ERROR( msg,"patch","overlapping edits" );
+            return -1;
+        }
+        size += splice.text.size() - ( splice.end - splice.begin );
+    }
+
+    out.reserve( size );
+    size_t pos = 0;
+    for ( std::vector<patch_splice>::const_iterator itr = ctx->splices.begin();
+        itr != ctx->splices.end(); ++itr )
+    {
+        out.append( ctx->str + pos,itr->begin - pos );
+        out.append( itr->text );
+        pos = itr->end;
+    }
+    out.append( ctx->str + pos,len - pos );
+
+    return 0;
+}
+
+int patch( lua_State *L )
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+    luaL_checktype( L,2,LUA_TTABLE );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+
+    lua_settop( L,2 );
+    {
+        patch_ctx ctx;
+        std::string out;
+        try
+        {
+            ctx.depth   = 0;
+            ctx.str     = str;
+            ctx.changes = 0;
+
+            return_code = patch_read_edits( L,2,&ctx,msg );
+            if ( 0 == return_code ) return_code = patch_scan( &ctx,str,len,msg );
+            if ( 0 == return_code ) return_code = patch_build( &ctx,len,out,msg );
+            if ( 0 == return_code )
+            {
+                lua_pushlstring( L,out.c_str(),out.size() );
+                lua_pushinteger( L,ctx.changes );
+            }
+        }
+        catch( const std::bad_alloc &e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"memory allocate fail",e.what() );
+        }
+        catch ( ... )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"patch","unknow error" );
+        }
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 2;
+}
+
+/* ============================ minify/pretty =============================== */
+/* xml.minify( str ),xml.pretty( str,indent )
+ * rewrite the tokens of str directly into a new string,no table is built.
+ * white space only text is dropped and tags are normalized,other text,cdata,
+ * attribute values and entities are copied as they are.an element without
+ * content become <name/>,a sole text child stay inline like rapidxml print.
+ * pretty trim the text it put on it's own line,so it's idempotent.minify
+ * keep a white space only text without line break between two sibling
+ * elements(e.g. <b>a</b> <i>b</i>),and drop comments.indent is a string or
+ * the number of spaces,"\t" by default.a document without root element is a
+ * error,like validate
+ */
+struct xml_rewriter
+{
+    xml_scanner s;
+    xml_token ahead[2]; /* lookahead queue */
+    int n_ahead;
+    int minify;
+    int root;   /* a root element was seen */
+    int last;   /* type of last scanned token */
+    std::string indent;
+    int level;
+    std::string out;
+};
+
+/* next meaningful token from scanner,error are checked here */
+int rewriter_scan( xml_rewriter *rw,xml_token *tk )
+{
+    while ( true )
+    {
+        switch ( scan_token( &rw->s,tk,1 ) )
+        {
+        case XS_EOF :
+            if ( 0 != rw->s.depth )
+            {
+                scan_incomplete( &rw->s,tk,1 );
+            }
+            else if ( !rw->root )
+            {
+                scan_error( tk,rw->s.end,"no root element" ); /* like validate */
+            }
+            break;
+        case XS_TEXT :
+            if ( tk->blank )
+            {
+                /* may be a space between two sibling elements,rewriter_run
+                 * keep it if a element follow
+                 */
+                if ( !rw->minify || 0 == rw->s.depth
+                    || ( XS_END != rw->last && XS_EMPTY != rw->last )
+                    || memchr( tk->name,'\n',tk->name_len ) )
+                {
+                    continue;
+                }
+                break;
+            }
+            if ( 0 == rw->s.depth ) scan_error( tk,tk->begin,"expected <" );
+            break;
+        case XS_CDATA :
+            if ( 0 == rw->s.depth ) scan_error( tk,tk->begin,"expected <" );
+            break;
+        case XS_START :
+        case XS_EMPTY :
+            rw->root = 1;
+            break;
+        case XS_MISC :
+            if ( rw->minify && tk->end - tk->begin >= 4
+                && 0 == memcmp( tk->begin,"<!--",4 ) )
+            {
+                continue; /* comment */
+            }
+            break;
+        default : break;
+        }
+
+        rw->last = tk->type;
+        return tk->type;
+    }
+
+    return XS_ERROR;
+}
+
+/* i-th token ahead */
+xml_token *rewriter_peek( xml_rewriter *rw,int i )
+{
+    while ( rw->n_ahead <= i )
+    {
+        rewriter_scan( rw,&rw->ahead[rw->n_ahead++] );
+    }
+    return &rw->ahead[i];
+}
+
+void rewriter_next( xml_rewriter *rw,xml_token *tk )
+{
+    if ( 0 == rw->n_ahead )
+    {
+        rewriter_scan( rw,tk );
+        return;
+    }
+
+    *tk = rw->ahead[0];
+    rw->ahead[0] = rw->ahead[1];
+    --rw->n_ahead;
+}
+
+void rewriter_line( xml_rewriter *rw )
+{
+    if ( rw->minify ) return;
+    for ( int i = 0;i < rw->level; ++i ) rw->out.append( rw->indent );
+}
+
+void rewriter_newline( xml_rewriter *rw )
+{
+    if ( !rw->minify ) rw->out.push_back( '\n' );
+}
+
+/* <name a="1" b='2' without the ending */
+void rewriter_tag( xml_rewriter *rw,const xml_token &tk )
+{
+    rw->out.push_back( '<' );
+    rw->out.append( tk.name,tk.name_len );
+
+    const char *pos = tk.attr;
+    const char *name = NULL;
+    const char *value = NULL;
+    size_t name_len = 0;
+    size_t value_len = 0;
+    while ( scan_attribute( &pos,tk.attr_end,&name,&name_len,&value,&value_len ) )
+    {
+        rw->out.push_back( ' ' );
+        rw->out.append( name,name_len );
+        rw->out.push_back( '=' );
+        rw->out.append( value - 1,value_len + 2 ); /* with quotes */
+    }
+}
+
+/* text or cdata as it is in source,text without leading and trailing white
+ * space if trim
+ */
+void rewriter_text( xml_rewriter *rw,const xml_token &tk,int trim )
+{
+    if ( XS_TEXT != tk.type )
+    {
+        rw->out.append( tk.begin,tk.end - tk.begin );
+        return;
+    }
+
+    const char *begin = tk.name;
+    const char *end = tk.name + tk.name_len;
+    if ( trim )
+    {
+        while ( begin < end && XS_WS( *begin ) ) ++begin;
+        while ( end > begin && XS_WS( end[-1] ) ) --end;
+    }
+    rw->out.append( begin,end - begin );
+}
+
+int rewriter_run( xml_rewriter *rw,const char *str,char *msg )
+{
+    xml_token tk;
+    while ( true )
+    {
+        rewriter_next( rw,&tk );
+        switch ( tk.type )
+        {
+        case XS_EOF : return 0;
+        case XS_ERROR :
+            MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+            return -1;
+        case XS_TEXT :
+        case XS_CDATA :
+            if ( XS_TEXT == tk.type && tk.blank ) /* minify only */
+            {
+                int next = rewriter_peek( rw,0 )->type;
+                if ( XS_START == next || XS_EMPTY == next ) rewriter_text( rw,tk,0 );
+                break;
+            }
+            rewriter_line( rw );
+            rewriter_text( rw,tk,!rw->minify );
+            rewriter_newline( rw );
+            break;
+        case XS_MISC :
+            rewriter_line( rw );
+            rw->out.append( tk.begin,tk.end - tk.begin );
+            rewriter_newline( rw );
+            break;
+        case XS_EMPTY :
+            rewriter_line( rw );
+            rewriter_tag( rw,tk );
+            rw->out.append( "/>",2 );
+            rewriter_newline( rw );
+            break;
+        case XS_START :
+        {
+            rewriter_line( rw );
+            rewriter_tag( rw,tk );
+
+            xml_token *next = rewriter_peek( rw,0 );
+            if ( XS_END == next->type ) /* no content */
+            {
+                rw->out.append( "/>",2 );
+                rewriter_newline( rw );
+                rewriter_next( rw,&tk );
+                break;
+            }
+
+            rw->out.push_back( '>' );
+            if ( ( XS_TEXT == next->type || XS_CDATA == next->type )
+                && XS_END == rewriter_peek( rw,1 )->type ) /* sole text */
+            {
+                rewriter_text( rw,*next,0 );
+                rewriter_next( rw,&tk );
+                rewriter_next( rw,&tk );
+                rw->out.append( "</",2 );
+                rw->out.append( tk.name,tk.name_len );
+                rw->out.push_back( '>' );
+                rewriter_newline( rw );
+                break;
+            }
+
+            rewriter_newline( rw );
+            ++rw->level;
+        }break;
+        case XS_END :
+            --rw->level;
+            rewriter_line( rw );
+            rw->out.append( "</",2 );
+            rw->out.append( tk.name,tk.name_len );
+            rw->out.push_back( '>' );
+            rewriter_newline( rw );
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int rewrite( lua_State *L,int minify )
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        xml_rewriter rw;
+        try
+        {
+            scan_init( &rw.s,str,str + len );
+            rw.n_ahead = 0;
+            rw.minify  = minify;
+            rw.root    = 0;
+            rw.last    = XS_EOF;
+            rw.level   = 0;
+            if ( LUA_TNUMBER == lua_type( L,2 ) )
+            {
+                lua_Integer spaces = lua_tointeger( L,2 );
+                rw.indent.assign( spaces > 0 ? (size_t)spaces : 0,' ' );
+            }
+            else if ( LUA_TSTRING == lua_type( L,2 ) )
+            {
+                size_t indent_len = 0;
+                const char *indent = lua_tolstring( L,2,&indent_len );
+                rw.indent.assign( indent,indent_len );
+            }
+            else
+            {
+                rw.indent.assign( 1,'\t' );
+            }
+            rw.out.reserve( len );
+
+            return_code = rewriter_run( &rw,str,msg );
+            if ( 0 == return_code )
+            {
+                lua_pushlstring( L,rw.out.c_str(),rw.out.size() );
+            }
+        }
+        catch( const std::bad_alloc &e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"memory allocate fail",e.what() );
+        }
+        catch ( ... )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"rewrite","unknow error" );
+        }
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+int minify( lua_State *L )
+{
+    return rewrite( L,1 );
+}
+
+int pretty( lua_State *L )
+{
+    return rewrite( L,0 );
+}
+
+/* ============================ validate ==================================== */
+/* xml.validate( str,{ closing_tags = true,max_depth = 0 } )
+ * check well-formedness with the scanner only,no node or table is allocated.
+ * closing tags are matched against a stack of start tag names unless
+ * closing_tags is false,a positive max_depth limit the nesting.return true,
+ * or nil,error message,byte offset
+ */
+struct validate_opts
+{
+    int closing_tags;
+    int max_depth;
+};
+
+/* return 0 if ok,else fill tk with the error */
+int validate_scan( xml_scanner *s,xml_token *tk,const validate_opts &opts,
+    std::vector< std::pair<const char *,size_t> > &names )
+{
+    int root = 0;
+    while ( true )
+    {
+        switch ( scan_token( s,tk,1 ) )
+        {
+        case XS_EOF :
+            if ( 0 != s->depth )
+            {
+                scan_incomplete( s,tk,1 );
+                return -1;
+            }
+            if ( !root )
+            {
+                scan_error( tk,s->end,"no root element" );
+                return -1;
+            }
+            return 0;
+        case XS_ERROR : return -1;
+        case XS_TEXT :
+            if ( !tk->blank && 0 == s->depth )
+            {
+                scan_error( tk,tk->begin,"expected <" );
+                return -1;
+            }
+            break;
+        case XS_CDATA :
+            if ( 0 == s->depth )
+            {
+                scan_error( tk,tk->begin,"expected <" );
+                return -1;
+            }
+            break;
+        case XS_START :
+            if ( opts.max_depth > 0 && s->depth > opts.max_depth )
+            {
+                scan_error( tk,tk->begin,"too deep" );
+                return -1;
+            }
+            if ( opts.closing_tags )
+            {
+                names.push_back( std::make_pair( tk->name,tk->name_len ) );
+            }
+            root = 1;
+            break;
+        case XS_EMPTY : root = 1; break;
+        case XS_END :
+            if ( opts.closing_tags )
+            {
+                const std::pair<const char *,size_t> &open = names.back();
+                if ( open.second != tk->name_len
+                    || 0 != memcmp( open.first,tk->name,tk->name_len ) )
+                {
+                    scan_error( tk,tk->begin,"invalid closing tag name" );
+                    return -1;
+                }
+                names.pop_back();
+            }
+            break;
+        default : break;
+        }
+    }
+
+    return 0;
+}
+
+int validate( lua_State *L )
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+
+    validate_opts opts;
+    opts.closing_tags = 1;
+    opts.max_depth    = 0;
+    if ( lua_istable( L,2 ) )
+    {
+        lua_getfield( L,2,"closing_tags" );
+        lua_getfield( L,2,"max_depth" );
+        opts.closing_tags = lua_isnil( L,-2 ) || lua_toboolean( L,-2 );
+        opts.max_depth    = (int)lua_tointeger( L,-1 );
+        lua_pop( L,2 );
+    }
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    xml_token tk;
+    {
+        xml_scanner s;
+        std::vector< std::pair<const char *,size_t> > names;
+        try
+        {
+            scan_init( &s,str,str + len );
+            return_code = validate_scan( &s,&tk,opts,names );
+        }
+        catch( const std::bad_alloc &e )
+        {
+            MARK_ERROR( msg,"memory allocate fail",e.what() );
+            return_code = -2;
+        }
+    }
+
+    if ( -2 == return_code )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_pushnil( L );
+        lua_pushstring( L,tk.what );
+        lua_pushinteger( L,(lua_Integer)( tk.end - str ) );
+        return 3;
+    }
+
+    lua_pushboolean( L,1 );
+    return 1;
+}
+
+/* ============================ compiled snapshot =========================== */
+/* xml.compile( file,out ) parse file once and write the decoded tree in a
+ * binary form,xml.load_compiled( path ) map it and build the same table as
+ * decode_from_file,without tokenizing any xml.
+ * layout,all integer are uint32 in native byte order:
+ *   header  : magic,byte order mark,version,node count,attribute count,
+ *             string count,string blob size,checksum of everything after
+ *   nodes   : { type,name,value,first_attr,nattr,first_child,nchild },in
+ *             breadth first order,so children are contiguous and always
+ *             after their parent
+ *   attrs   : { name,value }
+ *   strings : { offset,length } into blob,every distinct string once
+ *   blob
+ */
+#define SNAPSHOT_MAGIC   "LRXB"
+#define SNAPSHOT_BOM     0x01020304
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NONE    0xFFFFFFFF
+
+enum
+{
+    SNAPSHOT_ELEMENT = 0,
+    SNAPSHOT_TEXT    = 1
+};
+
+struct snapshot_header
+{
+    char magic[4];
+    uint32_t bom;
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t attr_count;
+    uint32_t string_count;
+    uint32_t blob_size;
+    uint32_t checksum;
+};
+
+struct snapshot_node
+{
+    uint32_t type;
+    uint32_t name;
+    uint32_t value;       /* string value,or SNAPSHOT_NONE */
+    uint32_t first_attr;
+    uint32_t nattr;
+    uint32_t first_child;
+    uint32_t nchild;
+};
+
+struct snapshot_attr
+{
+    uint32_t name;
+    uint32_t value;
+};
+
+struct snapshot_string
+{
+    uint32_t offset;
+    uint32_t len;
+};
+
+/* fnv-1a */
+uint32_t snapshot_checksum( const char *data,size_t len )
+{
+    uint32_t hash = 2166136261u;
+    const unsigned char *p = (const unsigned char *)data;
+    for ( size_t i = 0;i < len; ++i )
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct snapshot_writer
+{
+    std::vector<snapshot_node> nodes;
+    std::vector<snapshot_attr> attrs;
+    std::vector<snapshot_string> strings;
+    std::string blob;
+    std::unordered_map<std::string,uint32_t> index;
+};
+
+uint32_t snapshot_string_index( snapshot_writer *sw,const char *str,size_t len )
+{
+    std::string key( str,len );
+    std::unordered_map<std::string,uint32_t>::iterator itr = sw->index.find( key );
+    if ( itr != sw->index.end() ) return itr->second;
+
+    snapshot_string entry;
+    entry.offset = (uint32_t)sw->blob.size();
+    entry.len    = (uint32_t)len;
+    sw->blob.append( str,len );
+
+    uint32_t index = (uint32_t)sw->strings.size();
+    sw->strings.push_back( entry );
+    sw->index[key] = index;
+    return index;
+}
+
+/* fill record of a element,queue it's children.same rules as decode_element */
+void snapshot_element( snapshot_writer *sw,uint32_t index,
+    rapidxml::xml_node<> *node,std::vector<rapidxml::xml_node<> *> &queue )
+{
+    snapshot_node rec;
+    rec.type        = SNAPSHOT_ELEMENT;
+    rec.name        = snapshot_string_index( sw,node->name(),node->name_size() );
+    rec.value       = SNAPSHOT_NONE;
+    rec.first_attr  = (uint32_t)sw->attrs.size();
+    rec.nattr       = 0;
+    rec.first_child = 0;
+    rec.nchild      = 0;
+
+    for ( rapidxml::xml_attribute<> *attr = node->first_attribute();
+        attr; attr = attr->next_attribute() )
+    {
+        snapshot_attr arec;
+        arec.name  = snapshot_string_index( sw,attr->name(),attr->name_size() );
+        arec.value = snapshot_string_index( sw,attr->value(),attr->value_size() );
+        sw->attrs.push_back( arec );
+        ++rec.nattr;
+    }
+
+    rapidxml::xml_node<> *sub_node = node->first_node();
+    if ( node->value_size() != 0 || sub_node )
+    {
+        if ( sub_node->next_sibling()
+            || rapidxml::node_element == sub_node->type() )
+        {
+            rec.first_child = (uint32_t)queue.size();
+            for ( ;sub_node; sub_node = sub_node->next_sibling() )
+            {
+                queue.push_back( sub_node );
+                ++rec.nchild;
+            }
+        }
+        else
+        {
+            rec.value = snapshot_string_index(
+                sw,sub_node->value(),sub_node->value_size() );
+        }
+    }
+
+    sw->nodes[index] = rec;
+}
+
+int snapshot_build( snapshot_writer *sw,rapidxml::xml_node<> *root,char *msg )
+{
+    if ( !root || rapidxml::node_element != root->type() )
+    {
+        MARK_ERROR( msg,"compile","not a xml element" );
+        return -1;
+    }
+
+    /* queue[i] is the node of record i */
+    std::vector<rapidxml::xml_node<> *> queue;
+    queue.push_back( root );
+    for ( size_t i = 0;i < queue.size(); ++i )
+    {
+        sw->nodes.resize( queue.size() );
+
+        rapidxml::xml_node<> *node = queue[i];
+        if ( rapidxml::node_element == node->type() )
+        {
+            snapshot_element( sw,(uint32_t)i,node,queue );
+            continue;
+        }
+
+        snapshot_node &rec = sw->nodes[i];
+        memset( &rec,0,sizeof(rec) );
+        rec.type  = SNAPSHOT_TEXT;
+        rec.value = snapshot_string_index( sw,node->value(),node->value_size() );
+    }
+
+    if ( queue.size() >= SNAPSHOT_NONE || sw->blob.size() >= SNAPSHOT_NONE )
+    {
+        MARK_ERROR( msg,"compile","document too large" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* header and sections of a snapshot,as they are in file */
+void snapshot_serialize( snapshot_writer *sw,std::string &out )
+{
+    out.assign( sizeof(snapshot_header),'\0' );
+    out.append( (const char *)&sw->nodes[0],
+        sw->nodes.size() * sizeof(snapshot_node) );
+    if ( !sw->attrs.empty() )
+    {
+        out.append( (const char *)&sw->attrs[0],
+            sw->attrs.size() * sizeof(snapshot_attr) );
+    }
+    out.append( (const char *)&sw->strings[0],
+        sw->strings.size() * sizeof(snapshot_string) );
+    out.append( sw->blob );
+
+    const char *body = out.c_str() + sizeof(snapshot_header);
+
+    snapshot_header header;
+    memcpy( header.magic,SNAPSHOT_MAGIC,4 );
+    header.bom          = SNAPSHOT_BOM;
+    header.version      = SNAPSHOT_VERSION;
+    header.node_count   = (uint32_t)sw->nodes.size();
+    header.attr_count   = (uint32_t)sw->attrs.size();
+    header.string_count = (uint32_t)sw->strings.size();
+    header.blob_size    = (uint32_t)sw->blob.size();
+    header.checksum     =
+        snapshot_checksum( body,out.size() - sizeof(snapshot_header) );
+    memcpy( &out[0],&header,sizeof(header) );
+}
+
+/* write path.tmp and rename it over path,a old snapshot which is still
+ * mapped keep it's own inode,instead of being truncated under the proxies
+ */
+void snapshot_write( snapshot_writer *sw,const char *path )
+{
+    std::string image;
+    snapshot_serialize( sw,image );
+
+    std::string tmp( path );
+    tmp.append( ".tmp" );
+    try
+    {
+        std::ofstream out;
+        out.exceptions( std::ifstream::failbit | std::ifstream::badbit );
+        out.open( tmp.c_str(),
+            std::ofstream::out|std::ofstream::trunc|std::ofstream::binary );
+        out.write( image.c_str(),image.size() );
+        out.close();
+    }
+    catch ( ... )
+    {
+        unlink( tmp.c_str() );
+        throw;
+    }
+
+    if ( 0 != rename( tmp.c_str(),path ) )
+    {
+        int err = errno;
+        unlink( tmp.c_str() );
+        throw std::runtime_error( strerror( err ) );
+    }
+}
+
+int compile( lua_State *L )
+{
+    const char *path = luaL_checkstring( L,1 );
+    const char *out  = luaL_checkstring( L,2 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        rapidxml::xml_document<> doc;
+        snapshot_writer sw;
+        try
+        {
+            rapidxml::file<> in( path );
+            doc.parse<rapidxml::parse_non_destructive>( const_cast<char *>(in.data()) );
+            return_code = snapshot_build( &sw,doc.first_node(),msg );
+            if ( 0 == return_code ) snapshot_write( &sw,out );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::ifstream::failure &e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"write to file fail",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"compile fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"compile fail","unknow error" );
+        }
+
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    lua_pushboolean( L,1 );
+    return 1;
+}
+
+/* a mapped snapshot,every section is checked before use */
+struct snapshot_view
+{
+    const char *base;
+    size_t size;
+    const snapshot_header *header;
+    const snapshot_node *nodes;
+    const snapshot_attr *attrs;
+    const snapshot_string *strings;
+    const char *blob;
+};
+
+int snapshot_check( snapshot_view *sv,char *msg )
+{
+    if ( sv->size < sizeof(snapshot_header) )
+    {
+        MARK_ERROR( msg,"load compiled","file too small" );
+        return -1;
+    }
+
+    const snapshot_header *h = sv->header = (const snapshot_header *)sv->base;
+    if ( 0 != memcmp( h->magic,SNAPSHOT_MAGIC,4 ) || SNAPSHOT_BOM != h->bom )
+    {
+        MARK_ERROR( msg,"load compiled","not a compiled xml file" );
+        return -1;
+    }
+    if ( SNAPSHOT_VERSION != h->version )
+    {
+        MARK_ERROR( msg,"load compiled","version mismatch" );
+        return -1;
+    }
+
+    uint64_t size = sizeof(snapshot_header)
+        + (uint64_t)h->node_count * sizeof(snapshot_node)
+        + (uint64_t)h->attr_count * sizeof(snapshot_attr)
+        + (uint64_t)h->string_count * sizeof(snapshot_string)
+        + h->blob_size;
+    if ( size != sv->size || 0 == h->node_count )
+    {
+        MARK_ERROR( msg,"load compiled","size mismatch" );
+        return -1;
+    }
+
+    const char *body = sv->base + sizeof(snapshot_header);
+    if ( h->checksum != snapshot_checksum( body,sv->size - sizeof(snapshot_header) ) )
+    {
+        MARK_ERROR( msg,"load compiled","checksum mismatch" );
+        return -1;
+    }
+
+    sv->nodes   = (const snapshot_node *)body;
+    sv->attrs   = (const snapshot_attr *)( sv->nodes + h->node_count );
+    sv->strings = (const snapshot_string *)( sv->attrs + h->attr_count );
+    sv->blob    = (const char *)( sv->strings + h->string_count );
+
+    for ( uint32_t i = 0;i < h->string_count; ++i )
+    {
+        const snapshot_string &str = sv->strings[i];
+        if ( (uint64_t)str.offset + str.len > h->blob_size ) goto corrupt;
+    }
+    for ( uint32_t i = 0;i < h->attr_count; ++i )
+    {
+        const snapshot_attr &attr = sv->attrs[i];
+        if ( attr.name >= h->string_count || attr.value >= h->string_count )
+        {
+            goto corrupt;
+        }
+    }
+    for ( uint32_t i = 0;i < h->node_count; ++i )
+    {
+        const snapshot_node &node = sv->nodes[i];
+        if ( SNAPSHOT_TEXT == node.type )
+        {
+            if ( node.value >= h->string_count ) goto corrupt;
+            continue;
+        }
+        if ( SNAPSHOT_ELEMENT != node.type
+            || node.name >= h->string_count
+            || ( SNAPSHOT_NONE != node.value && node.value >= h->string_count )
+            || (uint64_t)node.first_attr + node.nattr > h->attr_count
+            || (uint64_t)node.first_child + node.nchild > h->node_count
+            || ( node.nchild && node.first_child <= i ) )
+        {
+            goto corrupt;
+        }
+    }
+    if ( SNAPSHOT_ELEMENT != sv->nodes[0].type ) goto corrupt;
+
+    return 0;
+
+corrupt:
+    MARK_ERROR( msg,"load compiled","corrupt node records" );
+    return -1;
+}
+
+/* push string i,every distinct string is created once through the cache */
+void snapshot_push_string( lua_State *L,snapshot_view *sv,int cache,uint32_t i )
+{
+    lua_rawgeti( L,cache,(lua_Integer)i + 1 );
+    if ( !lua_isnil( L,-1 ) ) return;
+
+    lua_pop( L,1 );
+    const snapshot_string &str = sv->strings[i];
+    lua_pushlstring( L,sv->blob + str.offset,str.len );
+    lua_pushvalue( L,-1 );
+    lua_rawseti( L,cache,(lua_Integer)i + 1 );
+}
+
+int snapshot_decode( lua_State *L,snapshot_view *sv,int cache,uint32_t i,char *msg )
+{
+    const snapshot_node &node = sv->nodes[i];
+    if ( SNAPSHOT_TEXT == node.type )
+    {
+        snapshot_push_string( L,sv,cache,node.value );
+        return 0;
+    }
+
+    int top = lua_gettop( L );
+    if ( top > MAX_STACK )
+    {
+        MARK_ERROR( msg,"xml decode","stack overflow" );
+        return -1;
+    }
+    if ( !lua_checkstack( L,5 ) )
+    {
+        MARK_ERROR( msg,"decode element","xml decode out of stack" );
+        return -1;
+    }
+
+    lua_createtable( L,0,3 );
+
+    lua_pushstring( L,NAME_KEY );
+    snapshot_push_string( L,sv,cache,node.name );
+    lua_rawset( L,-3 );
+
+    if ( node.nchild )
+    {
+        lua_pushstring( L,VALUE_KEY );
+        lua_createtable( L,node.nchild,0 );
+        for ( uint32_t c = 0;c < node.nchild; ++c )
+        {
+            if ( snapshot_decode( L,sv,cache,node.first_child + c,msg ) < 0 )
+            {
+                lua_settop( L,top );
+                return -1;
+            }
+            lua_rawseti( L,-2,c + 1 );
+        }
+        lua_rawset( L,-3 );
+    }
+    else if ( SNAPSHOT_NONE != node.value )
+    {
+        lua_pushstring( L,VALUE_KEY );
+        snapshot_push_string( L,sv,cache,node.value );
+        lua_rawset( L,-3 );
+    }
+
+    if ( node.nattr )
+    {
+        lua_pushstring( L,ATTR_KEY );
+        lua_createtable( L,0,node.nattr );
+        for ( uint32_t a = 0;a < node.nattr; ++a )
+        {
+            const snapshot_attr &attr = sv->attrs[node.first_attr + a];
+            snapshot_push_string( L,sv,cache,attr.name );
+            snapshot_push_string( L,sv,cache,attr.value );
+            lua_rawset( L,-3 );
+        }
+        lua_rawset( L,-3 );
+    }
+
+    return 0;
+}
+
+/* the mapping of a snapshot file,or a image in memory(decode cache),shared
+ * by all lazy proxies of it
+ */
+struct snapshot_map
+{
+    snapshot_view view;
+    std::string image;
+
+    snapshot_map()
+    {
+        view.base = NULL;
+        view.size = 0;
+    }
+    ~snapshot_map()
+    {
+        if ( view.base && image.empty() ) munmap( (void *)view.base,view.size );
+    }
+};
+
+int snapshot_open( snapshot_map *map,const char *path,char *msg )
+{
+    int fd = open( path,O_RDONLY );
+    struct stat st;
+    if ( fd < 0 || 0 != fstat( fd,&st ) )
+    {
+        MARK_ERROR( msg,"load compiled",strerror( errno ) );
+        if ( fd >= 0 ) close( fd );
+        return -1;
+    }
+
+    if ( st.st_size > 0 )
+    {
+        void *ptr = mmap( NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fd,0 );
+        if ( MAP_FAILED == ptr )
+        {
+            MARK_ERROR( msg,"load compiled",strerror( errno ) );
+            close( fd );
+            return -1;
+        }
+        map->view.base = (const char *)ptr;
+        map->view.size = (size_t)st.st_size;
+    }
+    close( fd );
+
+    return snapshot_check( &map->view,msg );
+}
+
+/* lazy proxy of a element,it's value array or it's attributes.nothing is
+ * decoded until accessed:
+ *   node.name,node.value[i],#node.value,node.attribute[name]
+ *   node:totable() decode the subtree into plain tables
+ */
+#define SNAPSHOT_PROXY_MT "lua_rapidxml.compiled_node"
+
+enum
+{
+    PROXY_ELEMENT   = 0,
+    PROXY_VALUE     = 1,
+    PROXY_ATTRIBUTE = 2
+};
+
+struct snapshot_proxy
+{
+    std::shared_ptr<snapshot_map> map;
+    uint32_t node;
+    int kind;
+};
+
+void snapshot_push_proxy( lua_State *L,
+    const std::shared_ptr<snapshot_map> &map,uint32_t node,int kind )
+{
+    snapshot_proxy *proxy =
+        (snapshot_proxy *)lua_newuserdata( L,sizeof(snapshot_proxy) );
+    new (proxy) snapshot_proxy();
+    luaL_getmetatable( L,SNAPSHOT_PROXY_MT );
+    lua_setmetatable( L,-2 );
+
+    proxy->map  = map;
+    proxy->node = node;
+    proxy->kind = kind;
+}
+
+void snapshot_push_raw( lua_State *L,const snapshot_view *sv,uint32_t i )
+{
+    const snapshot_string &str = sv->strings[i];
+    lua_pushlstring( L,sv->blob + str.offset,str.len );
+}
+
+/* field of a element proxy,return 0 if key is not a field */
+int snapshot_proxy_field( lua_State *L,snapshot_proxy *proxy,const char *key )
+{
+    const snapshot_view *sv = &proxy->map->view;
+    const snapshot_node &node = sv->nodes[proxy->node];
+
+    if ( 0 == strcmp( key,NAME_KEY ) )
+    {
+        snapshot_push_raw( L,sv,node.name );
+    }
+    else if ( 0 == strcmp( key,VALUE_KEY ) )
+    {
+        if ( node.nchild )
+        {
+            snapshot_push_proxy( L,proxy->map,proxy->node,PROXY_VALUE );
+        }
+        else if ( SNAPSHOT_NONE != node.value )
+        {
+            snapshot_push_raw( L,sv,node.value );
+        }
+        else
+        {
+            lua_pushnil( L );
+        }
+    }
+    else if ( 0 == strcmp( key,ATTR_KEY ) )
+    {
+        if ( node.nattr )
+        {
+            snapshot_push_proxy( L,proxy->map,proxy->node,PROXY_ATTRIBUTE );
+        }
+        else
+        {
+            lua_pushnil( L );
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* value of attribute key,return 0 if not found */
+int snapshot_proxy_attribute( lua_State *L,snapshot_proxy *proxy,
+    const char *key,size_t key_len )
+{
+    const snapshot_view *sv = &proxy->map->view;
+    const snapshot_node &node = sv->nodes[proxy->node];
+    for ( uint32_t a = 0;a < node.nattr; ++a )
+    {
+        const snapshot_attr &attr = sv->attrs[node.first_attr + a];
+        const snapshot_string &name = sv->strings[attr.name];
+        if ( name.len == key_len
+            && 0 == memcmp( sv->blob + name.offset,key,key_len ) )
+        {
+            snapshot_push_raw( L,sv,attr.value );
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* i-th item of value array,1 based */
+int snapshot_proxy_item( lua_State *L,snapshot_proxy *proxy,lua_Integer i )
+{
+    const snapshot_view *sv = &proxy->map->view;
+    const snapshot_node &node = sv->nodes[proxy->node];
+    if ( i < 1 || i > (lua_Integer)node.nchild ) return 0;
+
+    uint32_t child = node.first_child + (uint32_t)i - 1;
+    if ( SNAPSHOT_TEXT == sv->nodes[child].type )
+    {
+        snapshot_push_raw( L,sv,sv->nodes[child].value );
+    }
+    else
+    {
+        snapshot_push_proxy( L,proxy->map,child,PROXY_ELEMENT );
+    }
+
+    return 1;
+}
+
+int snapshot_proxy_index( lua_State *L )
+{
+    snapshot_proxy *proxy =
+        (snapshot_proxy *)luaL_checkudata( L,1,SNAPSHOT_PROXY_MT );
+
+    if ( LUA_TNUMBER == lua_type( L,2 ) )
+    {
+        if ( PROXY_VALUE != proxy->kind ) return 0;
+        return snapshot_proxy_item( L,proxy,lua_tointeger( L,2 ) );
+    }
+
+    size_t key_len = 0;
+    const char *key = lua_tolstring( L,2,&key_len );
+    if ( !key ) return 0;
+
+    if ( PROXY_ELEMENT == proxy->kind
+        && snapshot_proxy_field( L,proxy,key ) ) return 1;
+    if ( PROXY_ATTRIBUTE == proxy->kind
+        && snapshot_proxy_attribute( L,proxy,key,key_len ) ) return 1;
+
+    /* methods */
+    luaL_getmetatable( L,SNAPSHOT_PROXY_MT );
+    lua_pushvalue( L,2 );
+    lua_rawget( L,-2 );
+
+    return 1;
+}
+
+int snapshot_proxy_len( lua_State *L )
+{
+    snapshot_proxy *proxy =
+        (snapshot_proxy *)luaL_checkudata( L,1,SNAPSHOT_PROXY_MT );
+    const snapshot_node &node = proxy->map->view.nodes[proxy->node];
+
+    lua_pushinteger( L,PROXY_VALUE == proxy->kind ? node.nchild : 0 );
+    return 1;
+}
+
+int snapshot_proxy_totable( lua_State *L )
+{
+    snapshot_proxy *proxy =
+        (snapshot_proxy *)luaL_checkudata( L,1,SNAPSHOT_PROXY_MT );
+    snapshot_view *sv = &proxy->map->view;
+    const snapshot_node &node = sv->nodes[proxy->node];
+
+    char msg[MAX_MSG_LEN] = { 0 };
+    lua_settop( L,1 );
+    lua_newtable( L ); /* string cache */
+    switch ( proxy->kind )
+    {
+    case PROXY_ELEMENT :
+        if ( snapshot_decode( L,sv,2,proxy->node,msg ) < 0 )
+        {
+            lua_rapidxml_error( L,msg );
+            return 0;
+        }
+        break;
+    case PROXY_VALUE :
+        lua_createtable( L,node.nchild,0 );
+        for ( uint32_t c = 0;c < node.nchild; ++c )
+        {
+            if ( snapshot_decode( L,sv,2,node.first_child + c,msg ) < 0 )
+            {
+                lua_rapidxml_error( L,msg );
+                return 0;
+            }
+            lua_rawseti( L,-2,c + 1 );
+        }
+        break;
+    default :
+        lua_createtable( L,0,node.nattr );
+        for ( uint32_t a = 0;a < node.nattr; ++a )
+        {
+            const snapshot_attr &attr = sv->attrs[node.first_attr + a];
+            snapshot_push_raw( L,sv,attr.name );
+            snapshot_push_raw( L,sv,attr.value );
+            lua_rawset( L,-3 );
+        }
+        break;
+    }
+
+    return 1;
+}
+
+int snapshot_proxy_gc( lua_State *L )
+{
+    snapshot_proxy *proxy =
+        (snapshot_proxy *)lua_rapidxml_gc_udata( L,SNAPSHOT_PROXY_MT );
+    if ( !proxy ) return 0;
+
+    proxy->~snapshot_proxy();
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+/* load_compiled( path,{ lazy = true } ) */
+int load_compiled( lua_State *L )
+{
+    const char *path = luaL_checkstring( L,1 );
+
+    int lazy = 0;
+    if ( lua_istable( L,2 ) )
+    {
+        lua_getfield( L,2,"lazy" );
+        lazy = lua_toboolean( L,-1 );
+        lua_pop( L,1 );
+    }
+    lua_settop( L,1 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        std::shared_ptr<snapshot_map> map;
+        try
+        {
+            map = std::make_shared<snapshot_map>();
+            return_code = snapshot_open( map.get(),path,msg );
+        }
+        catch( const std::bad_alloc &e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"memory allocate fail",e.what() );
+        }
+
+        if ( 0 == return_code && lazy )
+        {
+            snapshot_push_proxy( L,map,0,PROXY_ELEMENT );
+        }
+        else if ( 0 == return_code )
+        {
+            /* string cache */
+            lua_createtable( L,map->view.header->string_count,0 );
+            return_code = snapshot_decode( L,&map->view,2,0,msg );
+        }
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* ============================ decode cache ================================ */
+/* decoded documents are kept as snapshot images in memory,shared by every lua
+ * state of the process.a file is keyed by it's path,device,inode,size and
+ * mtime,a string by it's whole content(a hash could collide).least recently
+ * used entries are dropped when the bytes exceed the budget,a proxy still
+ * referencing a dropped image keep it alive
+ */
+/* nanosecond part of the mtime,struct stat name it differently */
+#if defined(__APPLE__)
+    #define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#elif defined(__linux__) || ( defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L )
+    #define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#else
+    #define STAT_MTIME_NSEC(st) 0
+#endif
+
+struct cache_entry
+{
+    std::shared_ptr<snapshot_map> map;
+    size_t bytes;
+    std::list<const std::string *>::iterator lru;
+};
+
+struct decode_cache
+{
+    std::mutex mutex;
+    std::unordered_map<std::string,cache_entry> entries;
+    std::list<const std::string *> lru; /* most recently used first */
+    size_t budget; /* 0 means disabled */
+    size_t bytes;
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+};
+
+static decode_cache xml_cache;
+
+/* must hold the lock */
+void cache_evict( size_t budget )
+{
+    while ( xml_cache.bytes > budget && !xml_cache.lru.empty() )
+    {
+        std::unordered_map<std::string,cache_entry>::iterator itr =
+            xml_cache.entries.find( *xml_cache.lru.back() );
+        xml_cache.bytes -= itr->second.bytes;
+        xml_cache.lru.pop_back();
+        xml_cache.entries.erase( itr );
+        ++xml_cache.evictions;
+    }
+}
+
+std::shared_ptr<snapshot_map> cache_find( const std::string &key )
+{
+    std::lock_guard<std::mutex> guard( xml_cache.mutex );
+
+    std::unordered_map<std::string,cache_entry>::iterator itr =
+        xml_cache.entries.find( key );
+    if ( itr == xml_cache.entries.end() )
+    {
+        ++xml_cache.misses;
+        return std::shared_ptr<snapshot_map>();
+    }
+
+    ++xml_cache.hits;
+    xml_cache.lru.splice( xml_cache.lru.begin(),xml_cache.lru,itr->second.lru );
+    return itr->second.map;
+}
+
+void cache_insert( const std::string &key,const std::shared_ptr<snapshot_map> &map )
+{
+    std::lock_guard<std::mutex> guard( xml_cache.mutex );
+
+    size_t bytes = key.size() + map->view.size;
+    if ( bytes > xml_cache.budget ) return;
+
+    /* another thread may decode the same document at the same time */
+    std::unordered_map<std::string,cache_entry>::iterator itr =
+        xml_cache.entries.find( key );
+    if ( itr != xml_cache.entries.end() )
+    {
+        xml_cache.bytes -= itr->second.bytes;
+        xml_cache.lru.erase( itr->second.lru );
+        xml_cache.entries.erase( itr );
+    }
+
+    itr = xml_cache.entries.insert( std::make_pair( key,cache_entry() ) ).first;
+    xml_cache.lru.push_front( &itr->first );
+    itr->second.map   = map;
+    itr->second.bytes = bytes;
+    itr->second.lru   = xml_cache.lru.begin();
+    xml_cache.bytes  += bytes;
+
+    cache_evict( xml_cache.budget );
+}
+
+/* parse text and build a snapshot image of it */
+int cache_build( snapshot_map *map,char *text,char *msg )
+{
+    rapidxml::xml_document<> doc;
+    snapshot_writer sw;
+
+    /* nerver modify text */
+    doc.parse<rapidxml::parse_non_destructive>( text );
+    int return_code = snapshot_build( &sw,doc.first_node(),msg );
+    doc.clear();
+    if ( return_code < 0 ) return -1;
+
+    snapshot_serialize( &sw,map->image );
+    map->view.base = map->image.c_str();
+    map->view.size = map->image.size();
+
+    return snapshot_check( &map->view,msg );
+}
+
+int cache_string( std::shared_ptr<snapshot_map> &map,
+    const char *str,size_t len,char *msg )
+{
+    std::string key( 1,'s' );
+    key.append( str,len );
+
+    map = cache_find( key );
+    if ( map ) return 0;
+
+    map = std::make_shared<snapshot_map>();
+    if ( cache_build( map.get(),const_cast<char *>(str),msg ) < 0 ) return -1;
+
+    cache_insert( key,map );
+    return 0;
+}
+
+/* key and content come from the same descriptor,so a file replaced between
+ * stat and read is never cached under the old key
+ */
+int cache_file( std::shared_ptr<snapshot_map> &map,const char *path,char *msg )
+{
+    int fd = open( path,O_RDONLY );
+    struct stat st;
+    if ( fd < 0 || 0 != fstat( fd,&st ) )
+    {
+        MARK_ERROR( msg,"decode from file",strerror( errno ) );
+        if ( fd >= 0 ) close( fd );
+        return -1;
+    }
+
+    uint64_t stamp[5] =
+    {
+        (uint64_t)st.st_dev,(uint64_t)st.st_ino,(uint64_t)st.st_size,
+        (uint64_t)st.st_mtime,(uint64_t)STAT_MTIME_NSEC( st )
+    };
+    std::string key( 1,'f' );
+    key.append( (const char *)stamp,sizeof(stamp) );
+    key.append( path );
+
+    map = cache_find( key );
+    if ( map )
+    {
+        close( fd );
+        return 0;
+    }
+
+    std::vector<char> text;
+    try
+    {
+        text.resize( (size_t)st.st_size + 1,'\0' );
+    }
+    catch (...)
+    {
+        close( fd );
+        throw;
+    }
+
+    size_t size = 0;
+    while ( size < (size_t)st.st_size )
+    {
+        ssize_t n = read( fd,&text[size],(size_t)st.st_size - size );
+        if ( n < 0 && EINTR == errno ) continue;
+        if ( n <= 0 )
+        {
+            MARK_ERROR( msg,"decode from file",
+                n < 0 ? strerror( errno ) : "file truncated" );
+            close( fd );
+            return -1;
+        }
+        size += (size_t)n;
+    }
+    close( fd );
+
+    map = std::make_shared<snapshot_map>();
+    if ( cache_build( map.get(),&text[0],msg ) < 0 ) return -1;
+
+    cache_insert( key,map );
+    return 0;
+}
+
+/* 1 if the cache is enabled and options at index don't turn it off.cache
+ * option default to def
+ */
+int cache_option( lua_State *L,int index,int def,int *lazy )
+{
+    {
+        std::lock_guard<std::mutex> guard( xml_cache.mutex );
+        if ( 0 == xml_cache.budget ) return 0;
+    }
+
+    if ( !lua_istable( L,index ) ) return def;
+
+    lua_getfield( L,index,"cache" );
+    lua_getfield( L,index,"lazy" );
+    int use = lua_isnil( L,-2 ) ? def : lua_toboolean( L,-2 );
+    *lazy = lua_toboolean( L,-1 );
+    lua_pop( L,2 );
+
+    return use;
+}
+
+/* decode( str,{ cache = true } ) or decode_from_file( path ) with cache on */
+int decode_cached( lua_State *L,int from_file,int lazy )
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+    lua_settop( L,1 );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        std::shared_ptr<snapshot_map> map;
+        try
+        {
+            return_code = from_file ?
+                cache_file( map,str,msg ) : cache_string( map,str,len,msg );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        if ( 0 == return_code && lazy )
+        {
+            snapshot_push_proxy( L,map,0,PROXY_ELEMENT );
+        }
+        else if ( 0 == return_code )
+        {
+            /* string cache */
+            lua_createtable( L,map->view.header->string_count,0 );
+            return_code = snapshot_decode( L,&map->view,2,0,msg );
+        }
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* cache( budget ),budget in bytes,0 disable the cache and drop everything */
+int cache( lua_State *L )
+{
+    lua_Integer budget = luaL_checkinteger( L,1 );
+    if ( budget < 0 ) return luaL_argerror( L,1,"budget must not be negative" );
+
+    std::lock_guard<std::mutex> guard( xml_cache.mutex );
+    xml_cache.budget = (size_t)budget;
+    cache_evict( xml_cache.budget );
+
+    return 0;
+}
+
+int cache_stats( lua_State *L )
+{
+    std::lock_guard<std::mutex> guard( xml_cache.mutex );
+
+    lua_createtable( L,0,6 );
+    lua_pushinteger( L,(lua_Integer)xml_cache.hits );
+    lua_setfield( L,-2,"hits" );
+    lua_pushinteger( L,(lua_Integer)xml_cache.misses );
+    lua_setfield( L,-2,"misses" );
+    lua_pushinteger( L,(lua_Integer)xml_cache.evictions );
+    lua_setfield( L,-2,"evictions" );
+    lua_pushinteger( L,(lua_Integer)xml_cache.entries.size() );
+    lua_setfield( L,-2,"entries" );
+    lua_pushinteger( L,(lua_Integer)xml_cache.bytes );
+    lua_setfield( L,-2,"bytes" );
+    lua_pushinteger( L,(lua_Integer)xml_cache.budget );
+    lua_setfield( L,-2,"budget" );
+
+    return 1;
+}
+
+/* ========================== shared documents ============================== */
+/* immutable documents registered by name for the whole process.every lua
+ * state get it's own proxies(see load_compiled) over the same image,so the
+ * memory does not grow with the number of states or threads.a document stay
+ * until unshare,and after that until the last proxy is collected
+ */
+struct shared_registry
+{
+    std::mutex load;  /* held while parsing,so a name is parsed only once */
+    std::mutex mutex; /* held while docs is accessed */
+    std::unordered_map<std::string,std::shared_ptr<snapshot_map> > docs;
+};
+
+static shared_registry xml_shared;
+
+std::shared_ptr<snapshot_map> shared_find( const std::string &name )
+{
+    std::lock_guard<std::mutex> guard( xml_shared.mutex );
+
+    std::unordered_map<std::string,std::shared_ptr<snapshot_map> >::iterator
+        itr = xml_shared.docs.find( name );
+    if ( itr == xml_shared.docs.end() ) return std::shared_ptr<snapshot_map>();
+
+    return itr->second;
+}
+
+void shared_insert( const std::string &name,const std::shared_ptr<snapshot_map> &map )
+{
+    std::lock_guard<std::mutex> guard( xml_shared.mutex );
+
+    xml_shared.docs[name] = map;
+}
+
+/* load a document unless another thread did it while we were waiting */
+int shared_load( std::shared_ptr<snapshot_map> &map,
+    const char *name,const char *str,char *msg )
+{
+    std::lock_guard<std::mutex> guard( xml_shared.load );
+
+    map = shared_find( name );
+    if ( map ) return 0;
+
+    map = std::make_shared<snapshot_map>();
+    if ( str )
+    {
+        if ( cache_build( map.get(),const_cast<char *>(str),msg ) < 0 ) return -1;
+    }
+    else
+    {
+        rapidxml::file<> in( name );
+        if ( cache_build( map.get(),in.data(),msg ) < 0 ) return -1;
+    }
+
+    shared_insert( name,map );
+    return 0;
+}
+
+/* shared( path ) load a file,shared( name,str ) register a string.the
+ * document is parsed only by the first call of a name in the process
+ */
+int shared( lua_State *L )
+{
+    const char *name = luaL_checkstring( L,1 );
+    size_t len = 0;
+    const char *str = lua_isnoneornil( L,2 ) ? NULL : luaL_checklstring( L,2,&len );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        std::shared_ptr<snapshot_map> map;
+        try
+        {
+            map = shared_find( name );
+            if ( !map ) return_code = shared_load( map,name,str,msg );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        if ( 0 == return_code ) snapshot_push_proxy( L,map,0,PROXY_ELEMENT );
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* unshare( name ),return true if it was registered */
+int unshare( lua_State *L )
+{
+    const char *name = luaL_checkstring( L,1 );
+
+    size_t erased = 0;
+    {
+        std::shared_ptr<snapshot_map> map; /* released outside the lock */
+        std::lock_guard<std::mutex> guard( xml_shared.mutex );
+
+        std::unordered_map<std::string,std::shared_ptr<snapshot_map> >::iterator
+            itr = xml_shared.docs.find( name );
+        if ( itr != xml_shared.docs.end() )
+        {
+            map.swap( itr->second );
+            xml_shared.docs.erase( itr );
+            erased = 1;
+        }
+    }
+
+    lua_pushboolean( L,erased );
+    return 1;
+}
+
+/* ============================= hot reload ================================= */
+/* reload( tb,path ) parse the file again and change a decoded table in place,
+ * so references into it stay valid.children are matched by position,a
+ * element with the same name is updated in place,anything else is replaced.
+ * every change is recorded as
+ *   { path = "root/item[2]",node = element,field = "value",index = 3 }
+ *   { path = "root/item[2]",node = element,field = "attribute",key = "id" }
+ * field is "name"(root only),"value" or "attribute".index is set when one
+ * item of a value array changed,key when one attribute changed
+ */
+struct reload_ctx
+{
+    std::string path; /* path of current element,same form as patch */
+    int changes;      /* stack index of the change list,0 if not recorded */
+    int reuse;        /* reuse a child table even if the name is different */
+    lua_Integer count;
+    char *msg;
+};
+
+int reload_element( lua_State *L,reload_ctx *ctx,int tb,rapidxml::xml_node<> *node );
+
+void reload_change( lua_State *L,reload_ctx *ctx,int tb,const char *field,
+    const char *key,size_t key_len,lua_Integer index )
+{
+    if ( !ctx->changes ) return;
+
+    lua_createtable( L,0,5 );
+    lua_pushlstring( L,ctx->path.c_str(),ctx->path.size() );
+    lua_setfield( L,-2,"path" );
+    lua_pushvalue( L,tb );
+    lua_setfield( L,-2,"node" );
+    lua_pushstring( L,field );
+    lua_setfield( L,-2,"field" );
+    if ( key )
+    {
+        lua_pushlstring( L,key,key_len );
+        lua_setfield( L,-2,"key" );
+    }
+    if ( index > 0 )
+    {
+        lua_pushinteger( L,index );
+        lua_setfield( L,-2,"index" );
+    }
+
+    lua_rawseti( L,ctx->changes,++ctx->count );
+}
+
+/* 1 if value at index is a string equal to str */
+int reload_same( lua_State *L,int index,const char *str,size_t len )
+{
+    if ( LUA_TSTRING != lua_type( L,index ) ) return 0;
+
+    size_t old_len = 0;
+    const char *old = lua_tolstring( L,index,&old_len );
+    return old_len == len && 0 == memcmp( old,str,len );
+}
+
+void reload_attribute( lua_State *L,reload_ctx *ctx,int tb,rapidxml::xml_node<> *node )
+{
+    rapidxml::xml_attribute<> *attr = node->first_attribute();
+
+    lua_pushstring( L,ATTR_KEY );
+    lua_rawget( L,tb );
+    if ( !attr )
+    {
+        int had = !lua_isnil( L,-1 );
+        lua_pop( L,1 );
+        if ( had )
+        {
+            lua_pushstring( L,ATTR_KEY );
+            lua_pushnil( L );
+            lua_rawset( L,tb );
+            reload_change( L,ctx,tb,ATTR_KEY,NULL,0,0 );
+        }
+        return;
+    }
+
+    if ( !lua_istable( L,-1 ) )
+    {
+        lua_pop( L,1 );
+        lua_newtable( L );
+        lua_pushstring( L,ATTR_KEY );
+        lua_pushvalue( L,-2 );
+        lua_rawset( L,tb );
+    }
+    int attrs = lua_gettop( L );
+
+    for ( ;attr; attr = attr->next_attribute() )
+    {
+        lua_pushlstring( L,attr->name(),attr->name_size() );
+        lua_rawget( L,attrs );
+        int same = reload_same( L,-1,attr->value(),attr->value_size() );
+        lua_pop( L,1 );
+        if ( same ) continue;
+
+        lua_pushlstring( L,attr->name(),attr->name_size() );
+        lua_pushlstring( L,attr->value(),attr->value_size() );
+        lua_rawset( L,attrs );
+        reload_change( L,ctx,tb,ATTR_KEY,attr->name(),attr->name_size(),0 );
+    }
+
+    /* attributes gone from the file,removed after the traversal */
+    std::vector<std::string> gone;
+    lua_pushnil( L );
+    while ( lua_next( L,attrs ) )
+    {
+        lua_pop( L,1 );
+        size_t len = 0;
+        const char *key = LUA_TSTRING == lua_type( L,-1 ) ?
+            lua_tolstring( L,-1,&len ) : NULL;
+        if ( key && !node->first_attribute( key,len ) )
+        {
+            gone.push_back( std::string( key,len ) );
+        }
+    }
+    for ( size_t i = 0;i < gone.size(); ++i )
+    {
+        lua_pushlstring( L,gone[i].c_str(),gone[i].size() );
+        lua_pushnil( L );
+        lua_rawset( L,attrs );
+        reload_change( L,ctx,tb,ATTR_KEY,gone[i].c_str(),gone[i].size(),0 );
+    }
+
+    lua_pop( L,1 );
+}
+
+/* update value array arr of element tb,first is the first child node */
+int reload_array( lua_State *L,reload_ctx *ctx,int tb,int arr,rapidxml::xml_node<> *first )
+{
+    lua_Integer old_count = (lua_Integer)lua_rawlen( L,arr );
+    size_t base = ctx->path.size();
+    std::unordered_map<std::string,int> seen; /* n-th sibling of a name */
+
+    lua_Integer index = 0;
+    for ( rapidxml::xml_node<> *child = first; child; child = child->next_sibling() )
+    {
+        ++index;
+        lua_rawgeti( L,arr,index );
+        int old = lua_gettop( L );
+
+        if ( rapidxml::node_element != child->type() )
+        {
+            if ( !reload_same( L,old,child->value(),child->value_size() ) )
+            {
+                lua_pushlstring( L,child->value(),child->value_size() );
+                lua_rawseti( L,arr,index );
+                reload_change( L,ctx,tb,VALUE_KEY,NULL,0,index );
+            }
+            lua_pop( L,1 );
+            continue;
+        }
+
+        int same = ctx->reuse && lua_istable( L,old );
+        if ( !same && lua_istable( L,old ) )
+        {
+            lua_pushstring( L,NAME_KEY );
+            lua_rawget( L,old );
+            same = reload_same( L,-1,child->name(),child->name_size() );
+            lua_pop( L,1 );
+        }
+
+        /* path is only needed by the change list */
+        int nth = ctx->changes ?
+            ++seen[std::string( child->name(),child->name_size() )] : 0;
+        if ( same && ctx->changes )
+        {
+            ctx->path.append( 1,'/' ).append( child->name(),child->name_size() );
+            if ( nth > 1 )
+            {
+                char buf[32];
+                snprintf( buf,sizeof(buf),"[%d]",nth );
+                ctx->path.append( buf );
+            }
+        }
+        if ( same )
+        {
+            int return_code = reload_element( L,ctx,old,child );
+            ctx->path.resize( base );
+            if ( return_code < 0 ) return -1;
+        }
+        else
+        {
+            if ( decode_element( L,child,ctx->msg ) < 0 ) return -1;
+            lua_rawseti( L,arr,index );
+            reload_change( L,ctx,tb,VALUE_KEY,NULL,0,index );
+        }
+        lua_pop( L,1 );
+    }
+
+    /* from the end,so the array is still a sequence */
+    for ( lua_Integer i = old_count;i > index; --i )
+    {
+        lua_pushnil( L );
+        lua_rawseti( L,arr,i );
+        reload_change( L,ctx,tb,VALUE_KEY,NULL,0,i );
+    }
+
+    return 0;
+}
+
+int reload_value( lua_State *L,reload_ctx *ctx,int tb,rapidxml::xml_node<> *node )
+{
+    rapidxml::xml_node<> *sub_node = node->first_node();
+
+    lua_pushstring( L,VALUE_KEY );
+    lua_rawget( L,tb );
+    int old = lua_gettop( L );
+
+    int return_code = 0;
+    if ( 0 == node->value_size() && !sub_node )
+    {
+        if ( !lua_isnil( L,old ) )
+        {
+            lua_pushstring( L,VALUE_KEY );
+            lua_pushnil( L );
+            lua_rawset( L,tb );
+            reload_change( L,ctx,tb,VALUE_KEY,NULL,0,0 );
+        }
+    }
+    else if ( !sub_node->next_sibling()
+        && rapidxml::node_element != sub_node->type() )
+    {
+        /* value only contain one text,it's a string */
+        if ( !reload_same( L,old,sub_node->value(),sub_node->value_size() ) )
+        {
+            lua_pushstring( L,VALUE_KEY );
+            lua_pushlstring( L,sub_node->value(),sub_node->value_size() );
+            lua_rawset( L,tb );
+            reload_change( L,ctx,tb,VALUE_KEY,NULL,0,0 );
+        }
+    }
+    else if ( lua_istable( L,old ) )
+    {
+        return_code = reload_array( L,ctx,tb,old,sub_node );
+    }
+    else
+    {
+        lua_pushstring( L,VALUE_KEY );
+        return_code = decode_node( L,sub_node,ctx->msg );
+        if ( return_code >= 0 )
+        {
+            return_code = 0;
+            lua_rawset( L,tb );
+            reload_change( L,ctx,tb,VALUE_KEY,NULL,0,0 );
+        }
+    }
+
+    lua_settop( L,old - 1 );
+    return return_code;
+}
+
+int reload_element( lua_State *L,reload_ctx *ctx,int tb,rapidxml::xml_node<> *node )
+{
+    if ( lua_gettop( L ) > MAX_STACK )
+    {
+        MARK_ERROR( ctx->msg,"xml reload","stack overflow" );
+        return -1;
+    }
+    if ( !lua_checkstack( L,8 ) )
+    {
+        MARK_ERROR( ctx->msg,"xml reload","out of stack" );
+        return -1;
+    }
+
+    lua_pushstring( L,NAME_KEY );
+    lua_rawget( L,tb );
+    int same = reload_same( L,-1,node->name(),node->name_size() );
+    lua_pop( L,1 );
+    if ( !same )
+    {
+        lua_pushstring( L,NAME_KEY );
+        lua_pushlstring( L,node->name(),node->name_size() );
+        lua_rawset( L,tb );
+        reload_change( L,ctx,tb,NAME_KEY,NULL,0,0 );
+    }
+
+    reload_attribute( L,ctx,tb,node );
+    return reload_value( L,ctx,tb,node );
+}
+
+/* reload( tb,path ),return the change list.the file is parsed before any
+ * change,so a file which can't be read or parsed leave tb untouched.a error
+ * in the walk(stack overflow,out of memory) leave the changes made so far
+ */
+int reload( lua_State *L )
+{
+    luaL_checktype( L,1,LUA_TTABLE );
+    const char *path = luaL_checkstring( L,2 );
+    lua_settop( L,2 );
+    lua_newtable( L );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        rapidxml::xml_document<> doc;
+        reload_ctx ctx;
+        ctx.changes = 3;
+        ctx.reuse   = 0;
+        ctx.count   = 0;
+        ctx.msg     = msg;
+        try
+        {
+            rapidxml::file<> in( path );
+            /* nerver modify str */
+            doc.parse<rapidxml::parse_non_destructive>( const_cast<char *>(in.data()) );
+
+            rapidxml::xml_node<> *root = doc.first_node();
+            if ( !root || rapidxml::node_element != root->type() )
+            {
+                return_code = -1;
+                MARK_ERROR( msg,"xml reload","not a xml element" );
+            }
+            else
+            {
+                ctx.path.assign( root->name(),root->name_size() );
+                return_code = reload_element( L,&ctx,1,root );
+            }
+        }
+        catch ( const std::runtime_error& e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml reload fail",e.what() );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml reload fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml reload fail","unknow error" );
+        }
+
+        /* rapidxml static memory pool will never free,until you call clear */
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    lua_settop( L,3 );
+    return 1;
+}
+
+/* decode( str,{ into = tb } ),decode into a table decoded before.tables and
+ * strings of the same shape are reused,leftovers are removed.a failed decode
+ * may leave tb half updated
+ */
+int decode_into( lua_State *L )
+{
+    const char *str = luaL_checkstring( L,1 );
+    lua_settop( L,2 );
+    lua_getfield( L,2,"into" );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        rapidxml::xml_document<> doc;
+        reload_ctx ctx;
+        ctx.changes = 0;
+        ctx.reuse   = 1;
+        ctx.count   = 0;
+        ctx.msg     = msg;
+        try
+        {
+            /* nerver modify str */
+            doc.parse<rapidxml::parse_non_destructive>( const_cast<char *>(str) );
+
+            rapidxml::xml_node<> *root = doc.first_node();
+            if ( !root || rapidxml::node_element != root->type() )
+            {
+                return_code = -1;
+                MARK_ERROR( msg,"decode element","not a xml element" );
+            }
+            else
+            {
+                return_code = reload_element( L,&ctx,3,root );
+            }
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        /* rapidxml static memory pool will never free,until you call clear */
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
+    {
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    lua_settop( L,3 );
+    return 1;
+}
+
+/* ============================ file watcher ================================ */
+#ifdef __linux__
+/* report files(usually loaded by decode_from_file) changed on disk.the
+ * directory of a file is watched instead of the file,so a editor which write
+ * a temporary file and rename it over the old one is still seen.every event
+ * of a file restart it's settle time,a file is reported once when no more
+ * event arrive in settle milliseconds,so a burst become one change
+ */
+#define WATCHER_MT "lua_rapidxml.watcher"
+#define WATCH_MASK \
+    ( IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM )
+
+struct watch_dir
+{
+    std::unordered_map<std::string,std::string> files; /* basename to path */
+};
+
+struct watch_pending
+{
+    std::string path;
+    int64_t time; /* last event,in milliseconds */
+};
+
+struct xml_watcher
+{
+    int fd;
+    int64_t settle;
+    std::unordered_map<int,watch_dir> dirs; /* by watch descriptor */
+    std::vector<watch_pending> pending;     /* in order of first event */
+};
+
+int64_t watcher_now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+xml_watcher *watcher_check( lua_State *L )
+{
+    xml_watcher *watcher = (xml_watcher *)luaL_checkudata( L,1,WATCHER_MT );
+    if ( watcher->fd < 0 ) luaL_error( L,"watcher already closed" );
+
+    return watcher;
+}
+
+void watcher_mark( xml_watcher *watcher,const std::string &path,int64_t now )
+{
+    for ( std::vector<watch_pending>::iterator itr = watcher->pending.begin();
+        itr != watcher->pending.end(); ++itr )
+    {
+        if ( itr->path == path )
+        {
+            itr->time = now;
+            return;
+        }
+    }
+
+    watch_pending pending;
+    pending.path = path;
+    pending.time = now;
+    watcher->pending.push_back( pending );
+}
+
+/* read every queued event,return -1 on error */
+int watcher_drain( xml_watcher *watcher )
+{
+    alignas(struct inotify_event) char buf[4096];
+
+    int64_t now = watcher_now();
+    for ( ;; )
+    {
+        ssize_t len = read( watcher->fd,buf,sizeof(buf) );
+        if ( len < 0 )
+        {
+            if ( EINTR == errno ) continue;
+            return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+        }
+
+        for ( char *ptr = buf; ptr < buf + len; )
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            /* events are lost,every file may have changed */
+            if ( ev->mask & IN_Q_OVERFLOW )
+            {
+                std::unordered_map<int,watch_dir>::iterator dir;
+                for ( dir = watcher->dirs.begin(); dir != watcher->dirs.end(); ++dir )
+                {
+                    std::unordered_map<std::string,std::string>::iterator file;
+                    for ( file = dir->second.files.begin();
+                        file != dir->second.files.end(); ++file )
+                    {
+                        watcher_mark( watcher,file->second,now );
+                    }
+                }
+                continue;
+            }
+            if ( 0 == ev->len ) continue;
+
+            std::unordered_map<int,watch_dir>::iterator dir =
+                watcher->dirs.find( ev->wd );
+            if ( dir == watcher->dirs.end() ) continue;
+
+            std::unordered_map<std::string,std::string>::iterator file =
+                dir->second.files.find( ev->name );
+            if ( file != dir->second.files.end() )
+            {
+                watcher_mark( watcher,file->second,now );
+            }
+        }
+    }
+}
+
+/* split path into directory and basename */
+void watcher_split( const char *path,std::string &dir,std::string &base )
+{
+    const char *slash = strrchr( path,'/' );
+    if ( !slash )
+    {
+        dir  = ".";
+        base = path;
+        return;
+    }
+
+    dir  = slash == path ? std::string( "/" ) : std::string( path,slash - path );
+    base = slash + 1;
+}
+
+/* watcher:add( path ),return true or nil,error */
+int watcher_add( lua_State *L )
+{
+    xml_watcher *watcher = watcher_check( L );
+    const char *path = luaL_checkstring( L,2 );
+
+    std::string dir,base;
+    watcher_split( path,dir,base );
+    if ( base.empty() ) return luaL_argerror( L,2,"not a file path" );
+
+    int wd = inotify_add_watch( watcher->fd,dir.c_str(),WATCH_MASK );
+    if ( wd < 0 )
+    {
+        lua_pushnil( L );
+        lua_pushstring( L,strerror( errno ) );
+        return 2;
+    }
+
+    /* same directory always return same wd */
+    watcher->dirs[wd].files[base] = path;
+
+    lua_pushboolean( L,1 );
+    return 1;
+}
+
+/* watcher:remove( path ),return true if it was watched */
+int watcher_remove( lua_State *L )
+{
+    xml_watcher *watcher = watcher_check( L );
+    const char *path = luaL_checkstring( L,2 );
+
+    int removed = 0;
+    std::unordered_map<int,watch_dir>::iterator dir;
+    for ( dir = watcher->dirs.begin(); dir != watcher->dirs.end(); ++dir )
+    {
+        std::unordered_map<std::string,std::string> &files = dir->second.files;
+        std::unordered_map<std::string,std::string>::iterator file;
+        for ( file = files.begin(); file != files.end(); ++file )
+        {
+            if ( file->second == path ) break;
+        }
+        if ( file == files.end() ) continue;
+
+        files.erase( file );
+        if ( files.empty() )
+        {
+            inotify_rm_watch( watcher->fd,dir->first );
+            watcher->dirs.erase( dir );
+        }
+        removed = 1;
+        break;
+    }
+
+    for ( size_t i = 0;i < watcher->pending.size(); ++i )
+    {
+        if ( watcher->pending[i].path == path )
+        {
+            watcher->pending.erase( watcher->pending.begin() + i );
+            break;
+        }
+    }
+
+    lua_pushboolean( L,removed );
+    return 1;
+}
+
+/* watcher:poll(),never block.return a array of paths changed and settled */
+int watcher_poll( lua_State *L )
+{
+    xml_watcher *watcher = watcher_check( L );
+    if ( watcher_drain( watcher ) < 0 )
+    {
+        return luaL_error( L,"watcher read fail:%s",strerror( errno ) );
+    }
+
+    int64_t now = watcher_now();
+    lua_createtable( L,(int)watcher->pending.size(),0 );
+
+    lua_Integer index = 0;
+    std::vector<watch_pending>::iterator itr = watcher->pending.begin();
+    while ( itr != watcher->pending.end() )
+    {
+        if ( now - itr->time < watcher->settle )
+        {
+            ++itr;
+            continue;
+        }
+
+        lua_pushlstring( L,itr->path.c_str(),itr->path.size() );
+        lua_rawseti( L,-2,++index );
+        itr = watcher->pending.erase( itr );
+    }
+
+    return 1;
+}
+
+/* watcher:fd(),readable when there are events,for epoll or select */
+int watcher_fd( lua_State *L )
+{
+    xml_watcher *watcher = watcher_check( L );
+
+    lua_pushinteger( L,watcher->fd );
+    return 1;
+}
+
+int watcher_close( lua_State *L )
+{
+    xml_watcher *watcher = (xml_watcher *)luaL_checkudata( L,1,WATCHER_MT );
+    if ( watcher->fd >= 0 )
+    {
+        close( watcher->fd );
+        watcher->fd = -1;
+    }
+
+    return 0;
+}
+
+int watcher_gc( lua_State *L )
+{
+    xml_watcher *watcher = (xml_watcher *)lua_rapidxml_gc_udata( L,WATCHER_MT );
+    if ( !watcher ) return 0;
+
+    watcher_close( L );
+    watcher->~xml_watcher();
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+/* watcher( settle ),settle in milliseconds,default 0 */
+int watcher( lua_State *L )
+{
+    lua_Integer settle = luaL_optinteger( L,1,0 );
+
+    int fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( fd < 0 )
+    {
+        return luaL_error( L,"inotify init fail:%s",strerror( errno ) );
+    }
+
+    xml_watcher *watcher =
+        (xml_watcher *)lua_newuserdata( L,sizeof(xml_watcher) );
+    new (watcher) xml_watcher();
+    luaL_getmetatable( L,WATCHER_MT );
+    lua_setmetatable( L,-2 );
+
+    watcher->fd     = fd;
+    watcher->settle = settle > 0 ? (int64_t)settle : 0;
+
+    return 1;
+}
+#endif /* __linux__ */
+
+/* ============================ compact mode ================================ */
+/* another mapping for record like xml,with far fewer tables:
+ *   <item id="1"><hp>10</hp><buff>1</buff><buff>2</buff></item>
+ *   { id = "1",hp = "10",buff = { "1","2" } }
+ * attributes are fields(key prefixed by attr_prefix).a child element without
+ * attribute and child element is a string field.a key appear more than once
+ * (or listed in arrays) become a array.text of a element which is a table is
+ * at text_key.comments and order of siblings with different names are lost
+ */
+/* a key of the table being encoded,refer to the lua string */
+struct compact_key
+{
+    const char *str;
+    size_t len;
+
+    bool operator < ( const compact_key &other ) const
+    {
+        int cmp = memcmp( str,other.str,len < other.len ? len : other.len );
+        return cmp < 0 || ( 0 == cmp && len < other.len );
+    }
+};
+
+struct compact_opts
+{
+    std::string attr_prefix;
+    std::string text_key;
+    int arrays; /* stack index of { name = true } always decoded as array */
+    std::vector<compact_key> keys; /* encode,keys of every open table */
+};
+
+int compact_option( lua_State *L,int index )
+{
+    if ( !lua_istable( L,index ) ) return 0;
+
+    lua_getfield( L,index,"compact" );
+    int compact = lua_toboolean( L,-1 );
+    lua_pop( L,1 );
+
+    return compact;
+}
+
+void compact_read_opts( lua_State *L,int index,compact_opts *opts )
+{
+    opts->attr_prefix = "";
+    opts->text_key    = "_";
+    opts->arrays      = 0;
+    if ( !lua_istable( L,index ) ) return;
+
+    lua_getfield( L,index,"attr_prefix" );
+    if ( lua_isstring( L,-1 ) ) opts->attr_prefix = lua_tostring( L,-1 );
+    lua_getfield( L,index,"text_key" );
+    if ( lua_isstring( L,-1 ) ) opts->text_key = lua_tostring( L,-1 );
+    lua_pop( L,2 );
+
+    lua_getfield( L,index,"arrays" );
+    if ( lua_istable( L,-1 ) )
+    {
+        opts->arrays = lua_gettop( L ); /* leave it on stack */
+    }
+    else
+    {
+        lua_pop( L,1 );
+    }
+}
+
+/* tb[key] = value,key and value are on the top and popped.a key set again
+ * turn into a array,keys in arrays are the arrays created for this table
+ */
+void compact_set( lua_State *L,int tb,
+    compact_opts *opts,std::vector<std::string> &arrays )
+{
+    size_t len = 0;
+    const char *key = lua_tolstring( L,-2,&len );
+
+    lua_pushvalue( L,-2 );
+    lua_rawget( L,tb );
+    if ( lua_isnil( L,-1 ) )
+    {
+        lua_pop( L,1 );
+
+        int forced = 0;
+        if ( opts->arrays )
+        {
+            lua_pushvalue( L,-2 );
+            lua_rawget( L,opts->arrays );
+            forced = lua_toboolean( L,-1 );
+            lua_pop( L,1 );
+        }
+        if ( forced )
+        {
+            lua_createtable( L,2,0 );
+            lua_insert( L,-2 );
+            lua_rawseti( L,-2,1 );
+            arrays.push_back( std::string( key,len ) );
+        }
+        lua_rawset( L,tb );
+        return;
+    }
+
+    if ( std::find( arrays.begin(),arrays.end(),std::string( key,len ) )
+        != arrays.end() )
+    {
+        /* key,value,array */
+        lua_insert( L,-2 );
+        lua_rawseti( L,-2,(lua_Integer)lua_rawlen( L,-2 ) + 1 );
+        lua_pop( L,2 );
+        return;
+    }
+
+    /* key,value,old -> key,{ old,value } */
+    lua_createtable( L,2,0 );
+    lua_insert( L,-2 );
+    lua_rawseti( L,-2,1 );
+    lua_insert( L,-2 );
+    lua_rawseti( L,-2,2 );
+    arrays.push_back( std::string( key,len ) );
+    lua_rawset( L,tb );
+}
+
+/* push the value of a element.root is always a table */
+int compact_element( lua_State *L,
+    rapidxml::xml_node<> *node,compact_opts *opts,int root,char *msg )
+{
+    if ( lua_gettop( L ) > MAX_STACK )
+    {
+        MARK_ERROR( msg,"xml decode","stack overflow" );
+        return -1;
+    }
+    if ( !lua_checkstack( L,6 ) )
+    {
+        MARK_ERROR( msg,"decode element","xml decode out of stack" );
+        return -1;
+    }
+
+    int leaf = !root && !node->first_attribute();
+    rapidxml::xml_node<> *child = node->first_node();
+    for ( ;leaf && child; child = child->next_sibling() )
+    {
+        if ( rapidxml::node_element == child->type() ) leaf = 0;
+    }
+
+    /* one text,usually the only one,is pushed without copy */
+    std::string text;
+    int texts = 0;
+    for ( child = node->first_node(); child; child = child->next_sibling() )
+    {
+        if ( rapidxml::node_element == child->type() ) continue;
+        if ( 0 == texts++ )
+        {
+            lua_pushlstring( L,child->value(),child->value_size() );
+        }
+        else
+        {
+            if ( 2 == texts ) text.assign( lua_tostring( L,-1 ),lua_rawlen( L,-1 ) );
+            text.append( child->value(),child->value_size() );
+        }
+    }
+    if ( texts > 1 )
+    {
+        lua_pop( L,1 );
+        lua_pushlstring( L,text.c_str(),text.size() );
+    }
+
+    if ( leaf )
+    {
+        if ( 0 == texts ) lua_pushstring( L,"" );
+        return 0;
+    }
+
+    lua_createtable( L,0,4 );
+    int tb = lua_gettop( L );
+    std::vector<std::string> arrays;
+
+    if ( texts )
+    {
+        lua_pushlstring( L,opts->text_key.c_str(),opts->text_key.size() );
+        lua_pushvalue( L,tb - 1 );
+        compact_set( L,tb,opts,arrays );
+    }
+
+    std::string key( opts->attr_prefix );
+    for ( rapidxml::xml_attribute<> *attr = node->first_attribute();
+        attr; attr = attr->next_attribute() )
+    {
+        key.resize( opts->attr_prefix.size() );
+        key.append( attr->name(),attr->name_size() );
+        lua_pushlstring( L,key.c_str(),key.size() );
+        lua_pushlstring( L,attr->value(),attr->value_size() );
+        compact_set( L,tb,opts,arrays );
+    }
+
+    for ( child = node->first_node(); child; child = child->next_sibling() )
+    {
+        if ( rapidxml::node_element != child->type() ) continue;
+
+        lua_pushlstring( L,child->name(),child->name_size() );
+        if ( compact_element( L,child,opts,0,msg ) < 0 ) return -1;
+        compact_set( L,tb,opts,arrays );
+    }
+
+    if ( texts ) lua_remove( L,tb - 1 );
+    return 0;
+}
+
+/* decode( str,{ compact = true } ),return the table and name of root */
+int decode_compact( lua_State *L,int from_file )
+{
+    const char *str = luaL_checkstring( L,1 );
+    lua_settop( L,2 );
+
+    compact_opts opts;
+    compact_read_opts( L,2,&opts );
+    int top = lua_gettop( L );
+
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        rapidxml::xml_document<> doc;
+        try
+        {
+            char *text = const_cast<char *>(str);
+            std::unique_ptr< rapidxml::file<> > in;
+            if ( from_file )
+            {
+                in.reset( new rapidxml::file<>( str ) );
+                text = in->data();
+            }
+            /* nerver modify str */
+            doc.parse<rapidxml::parse_non_destructive>( text );
+
+            rapidxml::xml_node<> *root = doc.first_node();
+            if ( !root || rapidxml::node_element != root->type() )
+            {
+                return_code = -1;
+                MARK_ERROR( msg,"decode element","not a xml element" );
+            }
+            else
+            {
+                return_code = compact_element( L,root,&opts,1,msg );
+                if ( 0 == return_code )
+                {
+                    lua_pushlstring( L,root->name(),root->name_size() );
+                }
+            }
+        }
+        catch ( const std::runtime_error& e )
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (const rapidxml::parse_error& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"invalid xml string",e.what() );
+        }
+        catch (const std::exception& e)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
+        }
+
+        /* rapidxml static memory pool will never free,until you call clear */
+        doc.clear();
+    }
+
+    if ( return_code < 0 )
     {
-        MARK_ERROR( msg,"encode element","not a valid table" );
-        return NULL;
+        lua_rapidxml_error( L,msg );
+        return 0;
     }
 
-    int top = lua_gettop( L );
-    if ( top > MAX_STACK )
+    return lua_gettop( L ) - top;
+}
+
+/* a scalar field is a attribute if it has the attr_prefix.with a empty prefix
+ * a decoded attribute can't be told from a leaf child,so it's a child
+ */
+int compact_is_attribute( compact_opts *opts,const char *key,size_t len )
+{
+    const std::string &prefix = opts->attr_prefix;
+    if ( prefix.empty() ) return 0;
+
+    return len > prefix.size() && 0 == memcmp( key,prefix.c_str(),prefix.size() );
+}
+
+int compact_scalar( lua_State *L,int index )
+{
+    int type = lua_type( L,index );
+    return LUA_TSTRING == type || LUA_TNUMBER == type;
+}
+
+int compact_encode( lua_State *L,int index,const char *name,size_t name_len,
+    compact_opts *opts,std::string &out,int depth,char *msg )
+{
+    if ( depth > MAX_STACK )
     {
-        MARK_ERROR( msg,"encode element","stack overflow" );
-        return NULL;
+        MARK_ERROR( msg,"encode compact","stack overflow" );
+        return -1;
+    }
+    if ( !lua_checkstack( L,4 ) )
+    {
+        MARK_ERROR( msg,"encode compact","out of stack" );
+        return -1;
     }
 
-    if ( !lua_checkstack( L,3 ) )
+    int type = lua_type( L,index );
+    if ( LUA_TSTRING == type || LUA_TNUMBER == type )
     {
-        MARK_ERROR( msg,"encode element","out of stack" );
-        return NULL;
+        size_t len = 0;
+        if ( LUA_TSTRING == type ) lua_tolstring( L,index,&len );
+
+        out.push_back( '<' );
+        out.append( name,name_len );
+        if ( LUA_TSTRING == type && 0 == len )
+        {
+            out.append( "/>" );
+            return 0;
+        }
+        out.push_back( '>' );
+        if ( LUA_TNUMBER == type )
+        {
+            char _buffer[64];
+            out.append( _buffer,encode_number( lua_tonumber( L,index ),_buffer ) );
+        }
+        else
+        {
+            writer_escape( out,lua_tostring( L,index ),len,0 );
+        }
+        out.append( "</" );
+        out.append( name,name_len );
+        out.push_back( '>' );
+        return 0;
+    }
+    if ( LUA_TTABLE != type )
+    {
+        MARK_ERROR( msg,"encode compact","value must be string,number or table" );
+        return -1;
     }
 
-    lua_pushstring( L,NAME_KEY );
-    lua_rawget( L,index );
-    if ( !lua_isstring( L,top + 1 ) )
+    /* a array is the same element repeated */
+    size_t count = lua_rawlen( L,index );
+    if ( count > 0 )
     {
-        lua_settop( L,top );
-        MARK_ERROR( msg,"encode element","node name must be string" );
-        return NULL;
+        for ( size_t i = 1;i <= count; ++i )
+        {
+            lua_rawgeti( L,index,(lua_Integer)i );
+            int return_code = compact_encode(
+                L,lua_gettop( L ),name,name_len,opts,out,depth + 1,msg );
+            lua_pop( L,1 );
+            if ( return_code < 0 ) return -1;
+        }
+        return 0;
     }
-    rapidxml::xml_node<>* child = NULL;
 
-    size_t name_len = 0;
-    const char *pname = lua_tolstring( L,-1,&name_len );
-    /* do't worry about memory leak here,doc.clear() will free all */
-    const char *name = doc->allocate_string( pname,name_len );
-    lua_pop( L,1 ); /* pop name */
+    /* fields are written in order of key,so the output is the same every time.
+     * keys of this table are [base,end) of opts->keys
+     */
+    std::vector<compact_key> &keys = opts->keys;
+    size_t base = keys.size();
+    lua_pushnil( L );
+    while ( 0 != lua_next( L,index ) )
+    {
+        if ( LUA_TSTRING != lua_type( L,-2 ) )
+        {
+            MARK_ERROR( msg,"encode compact","all keys must be string" );
+            return -1;
+        }
+        compact_key key;
+        key.str = lua_tolstring( L,-2,&key.len );
+        if ( key.len != opts->text_key.size()
+            || 0 != memcmp( key.str,opts->text_key.c_str(),key.len ) )
+        {
+            keys.push_back( key );
+        }
+        lua_pop( L,1 );
+    }
+    size_t end = keys.size();
+    std::sort( keys.begin() + base,keys.end() );
 
-    lua_pushstring( L,VALUE_KEY );
+    out.push_back( '<' );
+    out.append( name,name_len );
+
+    /* attributes first,then text and child elements */
+    for ( size_t i = base;i < end; ++i )
+    {
+        const compact_key *itr = &keys[i];
+        lua_pushlstring( L,itr->str,itr->len );
+        lua_rawget( L,index );
+        if ( compact_scalar( L,-1 )
+            && compact_is_attribute( opts,itr->str,itr->len ) )
+        {
+            size_t skip = opts->attr_prefix.size();
+
+            size_t val_len = 0;
+            char _buffer[64];
+            const char *val = _buffer;
+            if ( LUA_TNUMBER == lua_type( L,-1 ) )
+            {
+                val_len = encode_number( lua_tonumber( L,-1 ),_buffer );
+            }
+            else
+            {
+                val = lua_tolstring( L,-1,&val_len );
+            }
+
+            /* quote with ' if value contain ",like rapidxml do */
+            char quote = memchr( val,'"',val_len ) ? '\'' : '"';
+            out.push_back( ' ' );
+            out.append( itr->str + skip,itr->len - skip );
+            out.push_back( '=' );
+            out.push_back( quote );
+            writer_escape( out,val,val_len,'\'' == quote ? '"' : '\'' );
+            out.push_back( quote );
+        }
+        lua_pop( L,1 );
+    }
+
+    out.push_back( '>' );
+    size_t open_end = out.size();
+
+    lua_pushlstring( L,opts->text_key.c_str(),opts->text_key.size() );
     lua_rawget( L,index );
-    switch ( lua_type( L,-1 ) )
+    if ( LUA_TNUMBER == lua_type( L,-1 ) )
     {
-    case LUA_TNIL :
+        char _buffer[64];
+        out.append( _buffer,encode_number( lua_tonumber( L,-1 ),_buffer ) );
+    }
+    else if ( LUA_TSTRING == lua_type( L,-1 ) )
     {
-        /* childless node,has no value and child node */
-        child = doc->allocate_node( rapidxml::node_element,name,0,name_len,0 );
-    }break;
-    case LUA_TNUMBER :
+        size_t len = 0;
+        const char *text = lua_tolstring( L,-1,&len );
+        writer_escape( out,text,len,0 );
+    }
+    lua_pop( L,1 );
+
+    for ( size_t i = base;i < end; ++i )
     {
-        char _buffer[64];
-        size_t val_len = 0;
-        double val = lua_tonumber( L,-1 );
+        compact_key key = keys[i]; /* keys grow in recursion */
+        lua_pushlstring( L,key.str,key.len );
+        lua_rawget( L,index );
+        if ( !compact_scalar( L,-1 )
+            || !compact_is_attribute( opts,key.str,key.len ) )
+        {
+            if ( compact_encode( L,lua_gettop( L ),
+                key.str,key.len,opts,out,depth + 1,msg ) < 0 )
+            {
+                return -1;
+            }
+        }
+        lua_pop( L,1 );
+    }
+    keys.resize( base );
+
+    if ( out.size() == open_end )
+    {
+        out[open_end - 1] = '/';
+        out.push_back( '>' );
+        return 0;
+    }
+
+    out.append( "</" );
+    out.append( name,name_len );
+    out.push_back( '>' );
+    return 0;
+}
+
+/* encode_compact( tb,name,opts ),the reverse of decode( str,{ compact = true } ) */
+int encode_compact( lua_State *L )
+{
+    luaL_checktype( L,1,LUA_TTABLE );
+    size_t name_len = 0;
+    const char *name = luaL_checklstring( L,2,&name_len );
+    lua_settop( L,3 );
+
+    compact_opts opts;
+    compact_read_opts( L,3,&opts );
 
-        if ( floor(val) == val ) /* integer */
+    int return_code = 0;
+    char msg[MAX_MSG_LEN] = { 0 };
+    {
+        std::string out;
+        try
         {
-            val_len = snprintf( _buffer,64,"%.0f",val );
+            writer_declaration( out,0 );
+            return_code = compact_encode( L,1,name,name_len,&opts,out,0,msg );
         }
-        else
+        catch (const std::exception& e)
         {
-            val_len = snprintf( _buffer,64,"%f",val );
+            return_code = -1;
+            MARK_ERROR( msg,"encode compact fail",e.what() );
         }
-        const char *value = doc->allocate_string( _buffer,val_len );
-        child = doc->allocate_node( 
-            rapidxml::node_element,name,value,name_len,val_len );
-    }break;
-    case LUA_TSTRING :
+
+        if ( 0 == return_code ) lua_pushlstring( L,out.c_str(),out.size() );
+    }
+
+    if ( return_code < 0 )
     {
-        size_t val_len = 0;
-        const char *val = lua_tolstring( L,-1,&val_len );
-        const char *value = doc->allocate_string( val,val_len );
-        child = doc->allocate_node( 
-            rapidxml::node_element,name,value,name_len,val_len );
-    }break;
-    case LUA_TTABLE :
+        lua_rapidxml_error( L,msg );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* =========================== columnar decode ============================== */
+/* decode_columns( str,"rows/row",{ "id","name" },opts ) turn a list of
+ * records into one array per field,no table is created for a record.a field
+ * is a attribute of the record,or text of a child element with that name.the
+ * light scanner is used,the rest of the document is only skipped
+ */
+enum
+{
+    COLUMN_AUTO   = 0, /* number if the whole value is a decimal number */
+    COLUMN_STRING = 1,
+    COLUMN_NUMBER = 2  /* missing if not a number */
+};
+
+struct column_field
+{
+    std::string name;
+    int type;
+};
+
+struct columns_ctx
+{
+    select_ctx select;                 /* path of record,names of current path */
+    std::vector<column_field> fields;
+    std::vector<char> seen;            /* field had value in current record */
+    int base;                          /* stack index of first column */
+    int missing;                       /* stack index of missing value */
+    lua_Integer rows;
+};
+
+int columns_field( columns_ctx *ctx,const char *name,size_t len )
+{
+    for ( size_t i = 0;i < ctx->fields.size(); ++i )
     {
-        child = doc->allocate_node( rapidxml::node_element,name,0,name_len );
-        if ( encode_node( L,top + 1,doc,child,msg ) < 0 )
+        const std::string &field = ctx->fields[i].name;
+        if ( field.size() == len && 0 == memcmp( field.c_str(),name,len ) )
         {
-            lua_settop( L,top );
-            return NULL;
+            return ctx->seen[i] ? -1 : (int)i;
         }
-    }break;
-    default:
-        lua_settop( L,top );
-        MARK_ERROR( msg,"encode element","unsupport value type" );
-        return NULL;
     }
-    lua_pop( L,1 ); /* pop value */
 
-    assert( child );
-    lua_pushstring( L,ATTR_KEY );
-    lua_rawget( L,index );
-    int type = lua_type( L,-1 );
-    if ( LUA_TNIL != type ) /* nil means no attribute,do nothing */
+    return -1;
+}
+
+/* push value as number,return 0 if it is not a decimal number */
+int columns_number( lua_State *L,const char *str,size_t len )
+{
+    char buffer[64];
+    if ( 0 == len || len >= sizeof(buffer) ) return 0;
+
+    /* strtod accept hex,inf,nan and leading spaces,xml value don't */
+    for ( size_t i = 0;i < len; ++i )
     {
-        if ( LUA_TTABLE != type )
+        char c = str[i];
+        if ( !( ( c >= '0' && c <= '9' ) || '-' == c || '+' == c
+            || '.' == c || 'e' == c || 'E' == c ) )
         {
-            lua_settop( L,top );
-            MARK_ERROR( msg,"encode element","attribute must be a table" );
-            return NULL;
+            return 0;
         }
+    }
+    memcpy( buffer,str,len );
+    buffer[len] = 0;
 
-        lua_pushnil( L );
-        while ( 0 != lua_next( L,-2 ) )
-        {
-            if ( LUA_TSTRING != lua_type( L,-1 ) 
-                || LUA_TSTRING != lua_type( L,-2 ) )
-            {
-                lua_settop( L,top );
-                MARK_ERROR( msg,"encode element",
-                    "all attribute key and value must be string" );
-                return NULL;
-            }
-            size_t key_len = 0;
-            size_t val_len = 0;
-            const char *key = lua_tolstring( L,-2,&key_len );
-            const char *val = lua_tolstring( L,-1,&val_len );
+    char *end = NULL;
+    errno = 0;
+    long long integer = strtoll( buffer,&end,10 );
+    if ( end == buffer + len && 0 == errno
+        && integer == (long long)(lua_Integer)integer )
+    {
+        lua_pushinteger( L,(lua_Integer)integer );
+        return 1;
+    }
 
-            child->append_attribute( 
-                doc->allocate_attribute( doc->allocate_string( key,key_len ),
-                doc->allocate_string( val,val_len ),key_len,val_len ) );
+    double number = strtod( buffer,&end );
+    if ( end != buffer + len ) return 0;
 
-            lua_pop( L,1 );
+    lua_pushnumber( L,number );
+    return 1;
+}
+
+void columns_set( lua_State *L,columns_ctx *ctx,int i,const char *str,size_t len )
+{
+    int type = ctx->fields[i].type;
+    if ( COLUMN_STRING == type || !columns_number( L,str,len ) )
+    {
+        if ( COLUMN_NUMBER == type )
+        {
+            lua_pushvalue( L,ctx->missing );
+        }
+        else
+        {
+            lua_pushlstring( L,str,len );
         }
     }
-    lua_pop( L,1 ); /* pop attribute */
 
-    return child;
+    lua_rawseti( L,ctx->base + i,ctx->rows );
+    ctx->seen[i] = 1;
 }
 
-int encode_node( lua_State *L,int index,
-    rapidxml::xml_document<> *doc,rapidxml::xml_node<> *node,char *msg )
+/* text of a child element,the start tag had been scanned.a child with
+ * element inside is skipped and gives no value
+ */
+int columns_child( lua_State *L,columns_ctx *ctx,xml_scanner *s,
+    xml_token *tk,int i,std::string &text )
 {
-    if ( !lua_istable( L,index ) )
+    int depth = s->depth - 1;
+    int pieces = 0;
+    int nested = 0;
+    const char *value = "";
+    size_t value_len = 0;
+    while ( true )
     {
-        MARK_ERROR( msg,"encode node","not a valid table" );
-        return -1;
+        switch ( scan_token( s,tk,1 ) )
+        {
+        case XS_EOF : return scan_incomplete( s,tk,1 );
+        case XS_ERROR : return XS_ERROR;
+        case XS_TEXT :
+        case XS_CDATA :
+            if ( XS_TEXT == tk->type && tk->blank ) break;
+            if ( 1 == ++pieces )
+            {
+                value     = tk->name;
+                value_len = tk->name_len;
+                break;
+            }
+            if ( 2 == pieces ) text.assign( value,value_len );
+            text.append( tk->name,tk->name_len );
+            break;
+        case XS_EMPTY : nested = 1; break;
+        case XS_START :
+            nested = 1;
+            if ( XS_ERROR == scan_skip_element( s,tk,1 ) ) return XS_ERROR;
+            break;
+        case XS_END :
+            if ( depth != s->depth ) break;
+            if ( nested ) return XS_END;
+            if ( pieces > 1 )
+            {
+                value     = text.c_str();
+                value_len = text.size();
+            }
+            columns_set( L,ctx,i,value,value_len );
+            return XS_END;
+        default : break;
+        }
     }
+}
 
-    int top = lua_gettop( L );
-    if ( top > MAX_STACK )
+/* one record,the start tag had been scanned */
+int columns_record( lua_State *L,columns_ctx *ctx,xml_scanner *s,xml_token *tk )
+{
+    ++ctx->rows;
+    std::fill( ctx->seen.begin(),ctx->seen.end(),0 );
+
+    const char *pos = tk->attr;
+    const char *name,*value;
+    size_t name_len,value_len;
+    while ( scan_attribute( &pos,tk->attr_end,&name,&name_len,&value,&value_len ) )
     {
-        MARK_ERROR( msg,"encode node","stack overflow" );
-        return -1;
+        int i = columns_field( ctx,name,name_len );
+        if ( i >= 0 ) columns_set( L,ctx,i,value,value_len );
+    }
+
+    if ( XS_START == tk->type )
+    {
+        std::string text;
+        int depth = s->depth - 1;
+        while ( true )
+        {
+            int type = scan_token( s,tk,1 );
+            if ( XS_ERROR == type ) return XS_ERROR;
+            if ( XS_EOF == type ) return scan_incomplete( s,tk,1 );
+            if ( XS_END == type && depth == s->depth ) break;
+
+            if ( XS_EMPTY == type )
+            {
+                int i = columns_field( ctx,tk->name,tk->name_len );
+                if ( i >= 0 ) columns_set( L,ctx,i,"",0 );
+            }
+            else if ( XS_START == type )
+            {
+                int i = columns_field( ctx,tk->name,tk->name_len );
+                type = i >= 0 ?
+                    columns_child( L,ctx,s,tk,i,text ) : scan_skip_element( s,tk,1 );
+                if ( XS_ERROR == type ) return XS_ERROR;
+            }
+        }
     }
 
-    if ( !lua_checkstack( L,5 ) )
+    for ( size_t i = 0;i < ctx->seen.size(); ++i )
     {
-        MARK_ERROR( msg,"encode node","out of stack" );
-        return -1;
+        if ( ctx->seen[i] ) continue;
+
+        lua_pushvalue( L,ctx->missing );
+        lua_rawseti( L,ctx->base + (int)i,ctx->rows );
     }
 
-    lua_pushnil( L );
-    while ( 0 != lua_next( L,index ) )
+    return XS_END;
+}
+
+int columns_scan( lua_State *L,columns_ctx *ctx,const char *str,size_t len,char *msg )
+{
+    xml_token tk;
+    xml_scanner s;
+
+    scan_init( &s,str,str + len );
+    while ( true )
     {
-        rapidxml::xml_node<> *child = 0;
-        /* if type is number or string,this node is data_node */
-        switch( lua_type( L,-1 ) )
+        switch ( scan_token( &s,&tk,1 ) )
         {
-        case LUA_TNUMBER :
+        case XS_EOF :
+            if ( 0 == s.depth ) return 0;
+            scan_incomplete( &s,&tk,1 );
+            MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+            return -1;
+        case XS_ERROR :
+            MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+            return -1;
+        case XS_TEXT :
+            if ( !tk.blank && 0 == s.depth )
+            {
+                scan_error( &tk,tk.begin,"expected <" );
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
+                return -1;
+            }
+            break;
+        case XS_END : ctx->select.names.pop_back(); break;
+        case XS_START :
+        case XS_EMPTY :
         {
-            char _buffer[64];
-            size_t val_len = 0;
-            double val = lua_tonumber( L,-1 );
+            ctx->select.names.push_back( std::make_pair( tk.name,tk.name_len ) );
 
-            if ( floor(val) == val ) /* integer */
+            int type = XS_END;
+            int match = select_match_path( &ctx->select );
+            if ( match > 0 )
             {
-                val_len = snprintf( _buffer,64,"%.0f",val );
+                type = columns_record( L,ctx,&s,&tk );
             }
-            else
+            else if ( match < 0 && XS_START == tk.type )
             {
-                val_len = snprintf( _buffer,64,"%f",val );
+                type = scan_skip_element( &s,&tk,1 );
             }
-            const char *value = doc->allocate_string( _buffer,val_len );
-            child = doc->allocate_node( rapidxml::node_data,0,value,0,val_len );
-        }break;
-        case LUA_TSTRING :
-        {
-            size_t val_len = 0;
-            const char *val = lua_tolstring( L,-1,&val_len );
-            const char *value = doc->allocate_string( val,val_len );
-            child = doc->allocate_node( rapidxml::node_data,0,value,0,val_len );
-        }break;
-        case LUA_TTABLE :
-        {
-            child = encode_element( L,top + 2,doc,msg );
-            if ( !child )
+            else if ( XS_START == tk.type )
             {
-                lua_settop( L,top );
+                break; /* a record may be inside */
+            }
+
+            if ( XS_ERROR == type )
+            {
+                MARK_SCAN_ERROR( msg,"invalid xml string",tk,str );
                 return -1;
             }
+            ctx->select.names.pop_back();
         }break;
-        default :
-            lua_settop( L,top );
-            MARK_ERROR( msg,
-                "encode node","node must be number,string or table" );
-            return -1;
+        default : break;
         }
-
-        assert( child );
-        node->append_node( child );
-
-        lua_pop( L,1 ); /* pop table value,iterate to next */
     }
 
     return 0;
 }
 
-int encode( lua_State *L )
+/* decode_columns( str,record_path,fields,{ infer = true,types = {},missing = false } )
+ * return { field = array },number of records
+ */
+int decode_columns( lua_State *L )
 {
-    if ( !lua_istable( L,1) )
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+    size_t path_len = 0;
+    const char *path = luaL_checklstring( L,2,&path_len );
+    luaL_checktype( L,3,LUA_TTABLE );
+    lua_settop( L,4 );
+
+    int infer = 1;
+    if ( lua_istable( L,4 ) )
     {
-        return luaL_error( L,"argument #1 table expect" );
+        lua_getfield( L,4,"infer" );
+        if ( !lua_isnil( L,-1 ) ) infer = lua_toboolean( L,-1 );
+        lua_getfield( L,4,"types" );
+        lua_getfield( L,4,"missing" );
     }
-
-    int pretty = lua_toboolean( L,2 );
+    else
+    {
+        lua_pushnil( L );
+        lua_pushnil( L );
+        lua_pushboolean( L,0 );
+    }
+    if ( lua_isnil( L,7 ) )
+    {
+        lua_pushboolean( L,0 );
+        lua_replace( L,7 );
+    }
+    int types = lua_istable( L,6 ) ? 6 : 0;
 
     int return_code = 0;
     char msg[MAX_MSG_LEN] = { 0 };
-
     {
-        rapidxml::xml_document<> doc;
+        columns_ctx ctx;
         try
         {
-            /* document type */
-            rapidxml::xml_node<>* dt = doc.allocate_node( rapidxml::node_pi,
-                doc.allocate_string("xml version=\"1.0\" encoding=\"utf-8\"") );
-            doc.append_node( dt );
+            ctx.select.filter = 0;
+            ctx.select.paths.push_back( select_path() );
+            select_parse_path( path,path_len,ctx.select.paths.back() );
 
-            rapidxml::xml_node<> *root = encode_element( L,1,&doc,msg );
-            if ( !root )
+            size_t n = lua_rawlen( L,3 );
+            for ( size_t i = 1;i <= n; ++i )
+            {
+                lua_rawgeti( L,3,(lua_Integer)i );
+                size_t field_len = 0;
+                const char *field = lua_tolstring( L,-1,&field_len );
+                if ( field )
+                {
+                    column_field cf;
+                    cf.name.assign( field,field_len );
+                    cf.type = infer ? COLUMN_AUTO : COLUMN_STRING;
+                    if ( types )
+                    {
+                        lua_getfield( L,types,cf.name.c_str() );
+                        const char *type = lua_tostring( L,-1 );
+                        if ( type && 0 == strcmp( type,"string" ) ) cf.type = COLUMN_STRING;
+                        if ( type && 0 == strcmp( type,"number" ) ) cf.type = COLUMN_NUMBER;
+                        if ( type && 0 == strcmp( type,"auto" ) ) cf.type = COLUMN_AUTO;
+                        lua_pop( L,1 );
+                    }
+                    ctx.fields.push_back( cf );
+                }
+                lua_pop( L,1 );
+            }
+            ctx.seen.resize( ctx.fields.size() );
+
+            if ( !lua_checkstack( L,(int)ctx.fields.size() + 8 ) )
             {
                 return_code = -1;
+                MARK_ERROR( msg,"decode columns","too many fields" );
             }
             else
             {
-                doc.append_node( root );
+                ctx.missing = 7;
+                ctx.base    = lua_gettop( L ) + 1;
+                ctx.rows    = 0;
+                for ( size_t i = 0;i < ctx.fields.size(); ++i ) lua_newtable( L );
 
-                std::string str;
-                rapidxml::print( std::back_inserter(str),
-                    doc,pretty ? 0 : rapidxml::print_no_indenting );
-                lua_pushstring( L,str.c_str() );
+                return_code = columns_scan( L,&ctx,str,len,msg );
             }
         }
-        catch( const std::bad_alloc &e )
+        catch (const std::exception& e)
         {
             return_code = -1;
-            MARK_ERROR( msg,"memory allocate fail",e.what() );
+            MARK_ERROR( msg,"xml decode fail",e.what() );
         }
-        catch ( ... )
+        catch (...)
         {
             return_code = -1;
-            MARK_ERROR( msg,"encode","unknow error" );
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
         }
 
-        doc.clear();
+        if ( 0 == return_code )
+        {
+            lua_createtable( L,0,(int)ctx.fields.size() );
+            for ( size_t i = 0;i < ctx.fields.size(); ++i )
+            {
+                lua_pushlstring( L,ctx.fields[i].name.c_str(),ctx.fields[i].name.size() );
+                lua_pushvalue( L,ctx.base + (int)i );
+                lua_rawset( L,-3 );
+            }
+            lua_pushinteger( L,ctx.rows );
+        }
     }
 
     if ( return_code < 0 )
@@ -501,65 +7445,265 @@ int encode( lua_State *L )
         return 0;
     }
 
+    return 2;
+}
+
+/* ============================= value slices =============================== */
+/* decode( str,{ slice = threshold } ) push a text value at least threshold
+ * bytes long as a slice,which point into the source instead of copying it.
+ * the source string is referenced until the slice is collected(a file is
+ * read into a buffer shared by it's slices).encode accept a slice as a value.
+ * slice can't be mixed with compact,into,cache = true or a yield option
+ */
+#define SLICE_MT "lua_rapidxml.slice"
+
+struct xml_slice
+{
+    const char *ptr;                            /* NULL once finalized */
+    size_t size;
+    int ref;                                    /* source string,or LUA_NOREF */
+    std::shared_ptr< std::vector<char> > owner; /* or the file content */
+};
+
+xml_slice *slice_check( lua_State *L,int index )
+{
+    xml_slice *slice = (xml_slice *)luaL_checkudata( L,index,SLICE_MT );
+    if ( !slice->ptr ) luaL_argerror( L,index,"slice is finalized" );
+
+    return slice;
+}
+
+int slice_view( lua_State *L,int index,const char **ptr,size_t *size )
+{
+    if ( LUA_TUSERDATA != lua_type( L,index ) ) return 0;
+    if ( !lua_getmetatable( L,index ) ) return 0;
+
+    luaL_getmetatable( L,SLICE_MT );
+    int is_slice = lua_rawequal( L,-1,-2 );
+    lua_pop( L,2 );
+    if ( !is_slice ) return 0;
+
+    xml_slice *slice = (xml_slice *)lua_touserdata( L,index );
+    if ( !slice->ptr ) return 0;
+
+    *ptr  = slice->ptr;
+    *size = slice->size;
+    return 1;
+}
+
+void slice_push( lua_State *L,const char *ptr,size_t size,const slice_source *source )
+{
+    luaL_checkstack( L,3,"xml decode out of stack" );
+
+    xml_slice *slice = (xml_slice *)lua_newuserdata( L,sizeof(xml_slice) );
+    new (slice) xml_slice();
+    luaL_getmetatable( L,SLICE_MT );
+    lua_setmetatable( L,-2 );
+
+    slice->ptr   = ptr;
+    slice->size  = size;
+    slice->ref   = LUA_NOREF;
+    slice->owner = source->owner;
+    if ( source->index )
+    {
+        lua_pushvalue( L,source->index );
+        slice->ref = luaL_ref( L,LUA_REGISTRYINDEX );
+    }
+}
+
+int slice_len( lua_State *L )
+{
+    xml_slice *slice = slice_check( L,1 );
+
+    lua_pushinteger( L,(lua_Integer)slice->size );
     return 1;
 }
 
-int encode_to_file( lua_State *L )
+int slice_tostring( lua_State *L )
 {
-    if ( !lua_istable( L,1) )
+    xml_slice *slice = slice_check( L,1 );
+
+    lua_pushlstring( L,slice->ptr,slice->size );
+    return 1;
+}
+
+/* slice:sub( i,j ),same as string.sub,return a string */
+int slice_sub( lua_State *L )
+{
+    xml_slice *slice = slice_check( L,1 );
+    lua_Integer size = (lua_Integer)slice->size;
+    lua_Integer i = luaL_checkinteger( L,2 );
+    lua_Integer j = luaL_optinteger( L,3,-1 );
+
+    if ( i < 0 ) i = i < -size ? 1 : size + i + 1;
+    if ( j < 0 ) j = size + j + 1;
+    if ( i < 1 ) i = 1;
+    if ( j > size ) j = size;
+
+    if ( i > j )
     {
-        return luaL_error( L,"argument #1 table expect" );
+        lua_pushliteral( L,"" );
     }
+    else
+    {
+        lua_pushlstring( L,slice->ptr + i - 1,(size_t)( j - i + 1 ) );
+    }
+    return 1;
+}
 
-    const char *path = luaL_checkstring( L,2 );
-    int pretty = lua_toboolean( L,3 );
+/* lightuserdata pointer and length */
+int slice_data( lua_State *L )
+{
+    xml_slice *slice = slice_check( L,1 );
+
+    lua_pushlightuserdata( L,(void *)slice->ptr );
+    lua_pushinteger( L,(lua_Integer)slice->size );
+    return 2;
+}
+
+/* slice:write( fd,offset ),return bytes written,or nil,error,bytes written */
+int slice_write( lua_State *L )
+{
+    xml_slice *slice = slice_check( L,1 );
+    int fd = (int)luaL_checkinteger( L,2 );
+    lua_Integer offset = luaL_optinteger( L,3,0 );
+    if ( offset < 0 || (size_t)offset > slice->size )
+    {
+        return luaL_error( L,"slice offset out of range" );
+    }
+
+    return write_fd( L,fd,slice->ptr + offset,slice->size - (size_t)offset );
+}
+
+int slice_gc( lua_State *L )
+{
+    xml_slice *slice = (xml_slice *)lua_rapidxml_gc_udata( L,SLICE_MT );
+    if ( !slice ) return 0;
+
+    if ( !slice->ptr ) return 0;
+
+    /* the source is released but the slice stay constructed,so a finalized
+     * slice can still be checked
+     */
+    if ( LUA_NOREF != slice->ref )
+    {
+        luaL_unref( L,LUA_REGISTRYINDEX,slice->ref );
+        slice->ref = LUA_NOREF;
+    }
+    slice->owner.reset();
+    slice->ptr  = NULL;
+    slice->size = 0;
+    lua_rapidxml_gc_done( L );
+
+    return 0;
+}
+
+/* threshold of slice option at index,0 if none */
+size_t slice_option( lua_State *L,int index )
+{
+    if ( !lua_istable( L,index ) ) return 0;
+
+    lua_getfield( L,index,"slice" );
+    if ( lua_isnil( L,-1 ) )
+    {
+        lua_pop( L,1 );
+        return 0;
+    }
+
+    lua_Number num = lua_tonumber( L,-1 );
+    lua_Integer threshold = lua_tointeger( L,-1 );
+    if ( LUA_TNUMBER != lua_type( L,-1 )
+        || threshold < 0 || (lua_Number)threshold != num )
+    {
+        return luaL_error( L,"slice must be a non-negative integer" );
+    }
+    lua_pop( L,1 );
+
+    return (size_t)threshold;
+}
+
+/* name of a option at index which can't be used with slice,NULL if none */
+const char *slice_conflict( lua_State *L,int index,int from_file )
+{
+    if ( compact_option( L,index ) ) return "compact";
+
+    lua_getfield( L,index,"cache" );
+    lua_getfield( L,index,"into" );
+    int cache = lua_toboolean( L,-2 );
+    int into  = lua_istable( L,-1 );
+    lua_pop( L,2 );
+
+    if ( cache ) return "cache";
+    if ( from_file ) return NULL; /* decode_from_file has no into or yield */
+    if ( into ) return "into";
+    if ( decode_yielding( L,index ) ) return "yield_nodes or yield_time";
+
+    return NULL;
+}
+
+/* decode( str,{ slice = threshold } ) or decode_from_file */
+int decode_slices( lua_State *L,int from_file )
+{
+    const char *conflict = slice_conflict( L,2,from_file );
+    if ( conflict ) return luaL_error( L,"slice can't be used with %s",conflict );
+
+    slice_source source;
+    source.threshold = slice_option( L,2 );
+    source.index     = from_file ? 0 : 1;
+
+    const char *str = luaL_checkstring( L,1 );
+    lua_settop( L,1 );
 
     int return_code = 0;
     char msg[MAX_MSG_LEN] = { 0 };
-
     {
         rapidxml::xml_document<> doc;
         try
         {
-            /* document type */
-            rapidxml::xml_node<> *dt = doc.allocate_node( rapidxml::node_pi,
-                doc.allocate_string("xml version=\"1.0\" encoding=\"utf-8\"") );
-            doc.append_node( dt );
-
-            rapidxml::xml_node<> *root = encode_element( L,1,&doc,msg);
-            if ( !root )
-            {
-                return_code = -1;
-            }
-            else  /* write to file */
+            char *text = const_cast<char *>(str);
+            if ( from_file )
             {
-                doc.append_node( root );
-                std::ofstream out;
-                out.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
-                out.open( path,std::ofstream::out|std::ofstream::trunc );
+                /* read into the buffer shared by slices,like rapidxml::file */
+                std::ifstream in( str,std::ios::binary );
+                if ( !in ) throw std::runtime_error( "cannot open file " + std::string( str ) );
+                in.unsetf( std::ios::skipws );
 
-                assert( out.good() );
-                rapidxml::print( std::ostream_iterator<char>(out),doc,
-                    pretty ? 0 : rapidxml::print_no_indenting );
-                out.close();
+                in.seekg( 0,std::ios::end );
+                size_t size = (size_t)in.tellg();
+                in.seekg( 0 );
+
+                source.owner = std::make_shared< std::vector<char> >( size + 1,'\0' );
+                in.read( &(*source.owner)[0],(std::streamsize)size );
+                if ( in.fail() || in.bad() ) throw std::runtime_error( "error reading stream" );
+                text = &(*source.owner)[0];
             }
+
+            /* nerver modify str */
+            doc.parse<rapidxml::parse_non_destructive>( text );
+            return_code = decode_element( L,doc.first_node(),msg,&source );
         }
-        catch( const std::bad_alloc &e )
+        catch ( const std::runtime_error& e )
         {
             return_code = -1;
-            MARK_ERROR( msg,"memory allocate fail",e.what() );
+            MARK_ERROR( msg,"xml decode fail",e.what() );
         }
-        catch (const std::ifstream::failure &e)
+        catch (const rapidxml::parse_error& e)
         {
             return_code = -1;
-            MARK_ERROR( msg,"write to file fail",e.what() );
+            MARK_ERROR( msg,"invalid xml string",e.what() );
         }
-        catch ( ... )
+        catch (const std::exception& e)
         {
             return_code = -1;
-            MARK_ERROR( msg,"encode_to_file","unknow error" );
+            MARK_ERROR( msg,"xml decode fail",e.what() );
+        }
+        catch (...)
+        {
+            return_code = -1;
+            MARK_ERROR( msg,"xml decode fail","unknow error" );
         }
 
+        /* rapidxml static memory pool will never free,until you call clear */
         doc.clear();
     }
 
@@ -569,7 +7713,6 @@ int encode_to_file( lua_State *L )
         return 0;
     }
 
-    lua_pushboolean( L,1 );
     return 1;
 }
 
@@ -608,12 +7751,158 @@ static const luaL_Reg lua_rapidxml_lib[] =
     {"decode", decode},
     {"encode_to_file", encode_to_file},
     {"decode_from_file", decode_from_file},
+    {"decode_select", decode_select},
+    {"each_record", each_record},
+    {"parser", parser},
+    {"decode_async", decode_async},
+    {"encode_stream", encode_stream},
+    {"buffer", buffer},
+    {"encode_into", encode_into},
+    {"template", xml_template_new},
+    {"patch", patch},
+    {"minify", minify},
+    {"pretty", pretty},
+    {"validate", validate},
+    {"compile", compile},
+    {"load_compiled", load_compiled},
+    {"cache", cache},
+    {"cache_stats", cache_stats},
+    {"shared", shared},
+    {"unshare", unshare},
+    {"reload", reload},
+    {"encode_compact", encode_compact},
+    {"decode_columns", decode_columns},
+#ifdef __linux__
+    {"watcher", watcher},
+#endif
+    {NULL, NULL}
+};
+
+static const luaL_Reg lua_rapidxml_parser[] =
+{
+    {"feed", parser_feed},
+    {"finish", parser_finish},
+    {"reset", parser_reset},
+    {"__gc", parser_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lua_rapidxml_decode_state[] =
+{
+    {"__gc", decode_state_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lua_rapidxml_encode_state[] =
+{
+    {"__gc", encode_state_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lua_rapidxml_buffer[] =
+{
+    {"len", buffer_len},
+    {"capacity", buffer_capacity},
+    {"tostring", buffer_tostring},
+    {"data", buffer_data},
+    {"clear", buffer_clear},
+    {"write", buffer_write},
+    {"__len", buffer_len},
+    {"__tostring", buffer_tostring},
+    {"__gc", buffer_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lua_rapidxml_template[] =
+{
+    {"render", template_render},
+    {"__gc", template_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lua_rapidxml_compiled_node[] =
+{
+    {"__index", snapshot_proxy_index},
+    {"__len", snapshot_proxy_len},
+    {"totable", snapshot_proxy_totable},
+    {"__gc", snapshot_proxy_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lua_rapidxml_slice[] =
+{
+    {"len", slice_len},
+    {"tostring", slice_tostring},
+    {"sub", slice_sub},
+    {"data", slice_data},
+    {"write", slice_write},
+    {"__len", slice_len},
+    {"__tostring", slice_tostring},
+    {"__gc", slice_gc},
+    {NULL, NULL}
+};
+
+#ifdef __linux__
+static const luaL_Reg lua_rapidxml_watcher[] =
+{
+    {"add", watcher_add},
+    {"remove", watcher_remove},
+    {"poll", watcher_poll},
+    {"fd", watcher_fd},
+    {"close", watcher_close},
+    {"__gc", watcher_gc},
+    {NULL, NULL}
+};
+#endif
+
+static const luaL_Reg lua_rapidxml_async[] =
+{
+    {"done", async_done},
+    {"result", async_result},
+    {"__gc", async_gc},
     {NULL, NULL}
 };
 
+/* metatable of a userdata,__index is a table of the methods only,so a
+ * metamethod like __gc can't be called as obj:__gc()
+ */
+void lua_rapidxml_meta( lua_State *L,const char *name,const luaL_Reg *l )
+{
+    luaL_newmetatable( L,name );
+    luaL_setfuncs_ex( L,l,0 );
+
+    /* unless the userdata has it's own __index */
+    lua_getfield( L,-1,"__index" );
+    if ( lua_isnil( L,-1 ) )
+    {
+        lua_newtable( L );
+        for ( ;l->name; ++l )
+        {
+            if ( 0 == strncmp( l->name,"__",2 ) ) continue;
+
+            lua_pushcfunction( L,l->func );
+            lua_setfield( L,-2,l->name );
+        }
+        lua_setfield( L,-3,"__index" );
+    }
+
+    lua_pop( L,2 );
+}
 
 int luaopen_lua_rapidxml( lua_State *L )
 {
+    lua_rapidxml_meta( L,PARSER_MT,lua_rapidxml_parser );
+    lua_rapidxml_meta( L,ASYNC_MT,lua_rapidxml_async );
+    lua_rapidxml_meta( L,DECODE_STATE_MT,lua_rapidxml_decode_state );
+    lua_rapidxml_meta( L,ENCODE_STATE_MT,lua_rapidxml_encode_state );
+    lua_rapidxml_meta( L,BUFFER_MT,lua_rapidxml_buffer );
+    lua_rapidxml_meta( L,TEMPLATE_MT,lua_rapidxml_template );
+    lua_rapidxml_meta( L,SNAPSHOT_PROXY_MT,lua_rapidxml_compiled_node );
+    lua_rapidxml_meta( L,SLICE_MT,lua_rapidxml_slice );
+#ifdef __linux__
+    lua_rapidxml_meta( L,WATCHER_MT,lua_rapidxml_watcher );
+#endif
+
     luaL_newlib(L, lua_rapidxml_lib);
     return 1;
 }
@@ -71,3 +71,370 @@ assert( ret,"encode_to_file fail" )
 local _xml_tb = xml.decode_from_file( "test.xml" );
 local _xml_str = xml.encode( _xml_tb,true )
 vd( _xml_str )
+
+-- only decode the matched elements,other subtree is skipped
+local sel_tb = xml.decode_select( xml_str,{ "root/library","root/entity/e" } )
+assert( #sel_tb == 6 and sel_tb[1].name == "library" and sel_tb[2].name == "e" )
+assert( sel_tb[1].attribute.note == "thanks" )
+
+local sel_ok,sel_err = pcall( xml.decode_select,xml_str,function() error( {} ) end )
+assert( not sel_ok and sel_err == "decode select:table" )
+sel_tb = xml.decode_select( xml_str,function( name,depth )
+    return depth == 2 and name == "cdata"
+end )
+assert( #sel_tb == 1 and sel_tb[1].name == "cdata" )
+
+-- stream the children of root one by one
+local names = {}
+local count = xml.each_record( "test.xml",2,function( tb )
+    table.insert( names,tb.name )
+end )
+assert( count == 6 and names[1] == "module" and names[6] == "childless" )
+local rec_ok,rec_err = pcall( xml.each_record,"test.xml",2,function() error( {} ) end )
+assert( not rec_ok and rec_err == "each record:table" )
+
+-- push parser,elements are emitted as soon as they close
+local xml_parser = xml.parser( 2 )
+local parsed = {}
+for i = 1,#xml_str,16 do
+    for _,elem in ipairs( xml_parser:feed( string.sub( xml_str,i,i + 15 ) ) ) do
+        table.insert( parsed,elem )
+    end
+end
+assert( #xml_parser:finish() == 0 )
+assert( #parsed == 6 and parsed[2].attribute.url == "github.com" )
+
+-- metamethods are not methods,a finalized userdata is rejected
+local gc_parser = xml.parser()
+local gc_feed,gc_fn = gc_parser.feed,getmetatable( gc_parser ).__gc
+assert( gc_parser.__gc == nil and gc_feed )
+gc_fn( gc_parser )
+gc_fn( gc_parser )
+assert( not pcall( gc_feed,gc_parser,"<a/>" ) )
+
+-- decode a slice of a larger buffer,bounded by length not by '\0'
+local slice_str = "<header/>" .. xml_str .. "<tail/>"
+local slice_tb = xml.decode( slice_str,9,#xml_str )
+assert( slice_tb.name == "root" and #slice_tb.value == #xml_tb.value )
+-- same parser as decode( str ),a '\0' end the document in both
+local nul_str = "<a>x\0y</a>"
+assert( not pcall( xml.decode,nul_str ) and not pcall( xml.decode,nul_str,0,#nul_str ) )
+
+-- parse in a worker thread,poll done() and take the table by result()
+local async = xml.decode_async( xml_str )
+while not async:done() do end
+local async_tb = async:result()
+assert( async_tb.name == "root" and #async_tb.value == #xml_tb.value )
+
+-- time-sliced decode,yield to the coroutine every few tokens
+local slices = 0
+local sliced_co = coroutine.wrap( function()
+    return xml.decode( xml_str,{ yield_nodes = 8 } )
+end )
+local sliced_tb
+repeat
+    slices = slices + 1
+    sliced_tb = sliced_co()
+until sliced_tb
+assert( slices > 1 and #sliced_tb.value == #xml_tb.value )
+
+-- time-sliced encode,yield every slice of text
+local chunks = {}
+local chunk_co = coroutine.wrap( function()
+    return false,xml.encode( xml_tb,{ pretty = true,yield_nodes = 4,chunk = true } )
+end )
+repeat
+    local chunk,last = chunk_co()
+    table.insert( chunks,chunk or last )
+until not chunk
+assert( #chunks > 1 and table.concat( chunks ) == xml.encode( xml_tb,true ) )
+
+-- a wide array of leaf elements,the stack don't grow with the siblings
+local wide_tb = { name = "rows",value = {} }
+for i = 1,3000 do
+    wide_tb.value[i] = { name = "row",attribute = { id = tostring( i ) } }
+end
+local wide_co = coroutine.wrap( function()
+    return xml.encode( wide_tb,{ yield_nodes = 100000 } )
+end )
+local wide_str = xml.encode( wide_tb )
+assert( wide_co() == wide_str )
+
+-- stream the text to a sink every chunk_size bytes
+local streamed = {}
+local stream_bytes = xml.encode_stream( xml_tb,function( chunk )
+    table.insert( streamed,chunk )
+end,{ pretty = true,chunk_size = 64 } )
+local stream_str = table.concat( streamed )
+assert( #streamed > 1 and stream_bytes == #stream_str )
+assert( stream_str == xml.encode( xml_tb,true ) )
+local sink_ok,sink_err = pcall( xml.encode_stream,xml_tb,function() error( {} ) end )
+assert( not sink_ok and sink_err == "encode_stream sink:table" )
+
+-- stream and file writer with a wide array of leaf elements
+local wide_streamed = {}
+xml.encode_stream( wide_tb,function( chunk )
+    table.insert( wide_streamed,chunk )
+end,{ chunk_size = 1024 } )
+assert( table.concat( wide_streamed ) == wide_str )
+local wide_file_co = coroutine.wrap( function()
+    return xml.encode_to_file( wide_tb,"wide.xml",{ yield_nodes = 100000 } )
+end )
+assert( wide_file_co() )
+local wide_file = io.open( "wide.xml","rb" )
+assert( wide_file:read( "*a" ) == wide_str )
+wide_file:close()
+os.remove( "wide.xml" )
+
+-- value array is encoded in sequence order,non-sequence keys are a error
+-- unless extra_keys = "ignore"
+local hybrid = { name = "h",value = { "a",{ name = "b" },"c",extra = "ignored" } }
+local hybrid_str = xml.encode( hybrid,{ extra_keys = "ignore" } )
+assert( string.find( hybrid_str,"<h>a<b/>c</h>",1,true ) )
+assert( not string.find( hybrid_str,"ignored",1,true ) )
+local hash_only = { name = "a",value = { k = { name = "b" } } }
+local ok,err = pcall( xml.encode,hash_only )
+assert( not ok and string.find( err,"non-sequence key",1,true ) )
+assert( not pcall( xml.encode,hybrid,{ extra_keys = "error" } ) )
+assert( not pcall( xml.encode,hybrid,{ extra_keys = "drop" } ) )
+assert( xml.encode( hash_only,{ extra_keys = "ignore" } ) ==
+    xml.encode( { name = "a" } ) )
+-- the table writer follow the same policy
+assert( not pcall( xml.encode_stream,hybrid,function() end ) )
+assert( xml.encode_into( hybrid,xml.buffer(),{ extra_keys = "ignore" } ) > 0 )
+local hybrid_co = coroutine.wrap( function()
+    return xml.encode( hybrid,{ yield_nodes = 1,extra_keys = "ignore" } )
+end )
+local hybrid_sliced repeat hybrid_sliced = hybrid_co() until hybrid_sliced
+assert( hybrid_sliced == hybrid_str )
+hybrid_co = coroutine.wrap( function()
+    return pcall( xml.encode,hybrid,{ yield_nodes = 1 } )
+end )
+assert( false == hybrid_co() )
+
+-- encoded nodes point at the lua strings,numbers are formatted and copied
+local built = string.rep( "ab",3 )
+local built_text = built .. "<&>"
+local refer_tb = { name = 7,attribute = { [built] = built_text .. "\"" },
+    value = { { name = built,value = 2.5 },built_text,42,
+        { name = 8,value = built_text } } }
+local refer_str = xml.encode( refer_tb )
+assert( refer_str == '<?xml version="1.0" encoding="utf-8" ?>' ..
+    [[<7 ababab='ababab&lt;&amp;&gt;"'><ababab>2.500000</ababab>]] ..
+    [[ababab&lt;&amp;&gt;42<8>ababab&lt;&amp;&gt;</8></7>]] )
+local refer_buf = xml.buffer()
+xml.encode_into( refer_tb,refer_buf )
+assert( refer_buf:tostring() == refer_str )
+
+-- numbers are formatted the same by every encoder
+local num_tb = { name = "n",value = { 0,-7,123456789012345,1e15,-0.0,2.5,-0.25,
+    { name = "v",value = 3 },{ name = "f",value = 1/3 } } }
+local num_str = '<?xml version="1.0" encoding="utf-8" ?><n>0-7123456789012345' ..
+    '1000000000000000-02.500000-0.250000<v>3</v><f>0.333333</f></n>'
+assert( xml.encode( num_tb ) == num_str )
+assert( xml.encode_to_file( num_tb,"num.xml" ) )
+local num_file = io.open( "num.xml","rb" )
+assert( num_file:read( "*a" ) == num_str )
+num_file:close()
+os.remove( "num.xml" )
+local num_chunks = {}
+xml.encode_stream( num_tb,function( chunk ) num_chunks[#num_chunks + 1] = chunk end )
+assert( table.concat( num_chunks ) == num_str )
+local num_co = coroutine.wrap( function()
+    return xml.encode( num_tb,{ yield_nodes = 1 } )
+end )
+local num_sliced repeat num_sliced = num_co() until num_sliced
+assert( num_sliced == num_str )
+local num_buf = xml.buffer()
+assert( xml.encode_into( num_tb,num_buf ) == #num_str )
+assert( num_buf:tostring() == num_str )
+
+-- exact size pass,same output
+assert( xml.encode( xml_tb,{ pretty = true,presize = true } ) == xml.encode( xml_tb,true ) )
+assert( xml.encode( xml_tb,{ presize = true } ) == xml.encode( xml_tb ) )
+
+-- encode into a reusable buffer,the capacity is kept
+local xml_buf = xml.buffer()
+local buf_len = xml.encode_into( xml_tb,xml_buf,true )
+assert( buf_len == #xml_buf and tostring( xml_buf ) == xml.encode( xml_tb,true ) )
+local buf_cap = xml_buf:capacity()
+xml.encode_into( { name = "small" },xml_buf )
+assert( xml_buf:capacity() == buf_cap and xml.decode( xml_buf,0,#xml_buf ).name == "small" )
+local buf_ptr,buf_ptr_len = xml_buf:data()
+assert( xml.decode( buf_ptr,0,buf_ptr_len ).name == "small" and not pcall( xml.decode,buf_ptr,0 ) )
+assert( xml.encode_into( wide_tb,xml_buf ) == #wide_str and tostring( xml_buf ) == wide_str )
+
+-- precompiled template,values are escaped for text or attribute
+local tpl = xml.template( '<msg id="${id}" to=\'${to}\'><body>${body}</body></msg>' )
+local tpl_str = tpl:render( { id = 7,to = "a'b\"",body = "x<y" } )
+assert( tpl_str == '<msg id="7" to=\'a&apos;b"\'><body>x&lt;y</body></msg>' )
+assert( not pcall( xml.template,"<${name}/>" ) )
+
+-- exact integer are printed without exponent or fraction,-0 keep its sign
+local num_tpl = xml.template( "<n>${v}</n>" )
+assert( num_tpl:render( { v = 0 } ) == "<n>0</n>" )
+assert( num_tpl:render( { v = -42 } ) == "<n>-42</n>" )
+assert( num_tpl:render( { v = -0.0 } ) == "<n>-0</n>" )
+assert( num_tpl:render( { v = 999999999999999 } ) == "<n>999999999999999</n>" )
+assert( num_tpl:render( { v = 1e15 } ) == "<n>1000000000000000</n>" )
+assert( num_tpl:render( { v = -2^53 } ) == "<n>-9007199254740992</n>" )
+
+-- patch a document in place,untouched text is copied verbatim
+local patch_src = '<r>\n  <!-- c -->\n  <i id="1">a</i>\n  <i id="2"/>\n  <j/>\n</r>'
+local patched,changes = xml.patch( patch_src,
+    { ["r/i[2]"] = "b&c",["r/i[1]@id"] = 9,["r/j"] = false } )
+assert( changes == 3 )
+assert( patched == '<r>\n  <!-- c -->\n  <i id="9">a</i>\n  <i id="2">b&amp;c</i>\n  \n</r>' )
+assert( not pcall( xml.patch,patch_src,{ ["r/i[1]"] = "x",["r/i[1]/k"] = "y" } ) )
+assert( not pcall( xml.patch,patch_src,{ ["r/*"] = false,["r/i@id"] = "3" } ) )
+assert( not pcall( xml.patch,patch_src,{ ["r/i[2x]"] = "x" } ) )
+-- two paths to the same attribute
+assert( not pcall( xml.patch,"<root/>",{ ["root@x"] = 1,["root[1]@x"] = 2 } ) )
+assert( not pcall( xml.patch,patch_src,{ ["r/i@id"] = false,["r/*[1]@id"] = 4 } ) )
+assert( select( 2,xml.patch( "<root/>",{ ["root@x"] = 1,["root[1]@y"] = 2 } ) ) == 2 )
+
+-- reformat string to string
+local loose = '<?xml version="1.0"?>\n<!-- c -->\n<a  x="1" >\n  <b>t</b>\n  <c></c>\n</a>\n'
+assert( xml.minify( loose ) == '<?xml version="1.0"?><a x="1"><b>t</b><c/></a>' )
+assert( not pcall( xml.minify,"" ) and not pcall( xml.pretty,"<!-- c -->" ) )
+assert( not xml.validate( "" ) )
+assert( xml.pretty( loose,2 ) ==
+    '<?xml version="1.0"?>\n<!-- c -->\n<a x="1">\n  <b>t</b>\n  <c/>\n</a>\n' )
+-- pretty trim text on it's own line,minify keep a space between siblings
+local mixed = xml.pretty( "<a> <b>x</b> t </a>",2 )
+assert( mixed == "<a>\n  <b>x</b>\n  t\n</a>\n" and xml.pretty( mixed,2 ) == mixed )
+assert( xml.minify( "<p><b>a</b> <i>b</i></p>" ) == "<p><b>a</b> <i>b</i></p>" )
+assert( xml.minify( "<p>\n  <b>a</b>\n  <i>b</i>\n</p>" ) == "<p><b>a</b><i>b</i></p>" )
+
+-- well-formedness check without building anything
+assert( xml.validate( xml_str ) )
+local valid,valid_err,valid_offset = xml.validate( "<a><b></c></a>" )
+assert( not valid and valid_err == "invalid closing tag name" and valid_offset == 6 )
+
+-- compiled snapshot,eager and lazy
+assert( xml.compile( "test.xml","test.bin" ) )
+local compiled_tb = xml.load_compiled( "test.bin" )
+local function same( a,b )
+    if type( a ) ~= "table" or type( b ) ~= "table" then return a == b end
+    for k,v in pairs( a ) do if not same( v,b[k] ) then return false end end
+    for k in pairs( b ) do if nil == a[k] then return false end end
+    return true
+end
+assert( same( compiled_tb,xml.decode_from_file( "test.xml" ) ) )
+local lazy_tb = xml.load_compiled( "test.bin",{ lazy = true } )
+assert( lazy_tb.name == "root" and #lazy_tb.value == #compiled_tb.value )
+assert( lazy_tb.value[2].attribute.url == compiled_tb.value[2].attribute.url )
+-- compile over a mapped snapshot,the old proxies still read the old one
+assert( xml.encode_to_file( { name = "tiny" },"tiny.xml" ) )
+assert( xml.compile( "tiny.xml","test.bin" ) )
+assert( xml.load_compiled( "test.bin" ).name == "tiny" )
+assert( lazy_tb.value[2].attribute.url == compiled_tb.value[2].attribute.url )
+os.remove( "tiny.xml" )
+os.remove( "test.bin" )
+
+-- decode cache,a unchanged file is decoded from the cached image
+xml.cache( 16 * 1024 * 1024 )
+assert( same( xml.decode_from_file( "test.xml" ),compiled_tb ) )
+assert( same( xml.decode_from_file( "test.xml" ),compiled_tb ) )
+assert( xml.decode_from_file( "test.xml",{ lazy = true } ).name == "root" )
+local cache_stats = xml.cache_stats()
+assert( cache_stats.hits == 2 and cache_stats.misses == 1 and cache_stats.entries == 1 )
+assert( not pcall( xml.decode,xml_str,{ cache = true,yield_nodes = 8 } ) )
+xml.cache( 0 )
+assert( xml.cache_stats().entries == 0 )
+
+-- shared immutable document,parsed once per process
+local shared_doc = xml.shared( "test.xml" )
+assert( same( shared_doc:totable(),compiled_tb ) )
+assert( xml.shared( "shared_str","<a><b>1</b></a>" ).value[1].value == "1" )
+assert( xml.shared( "shared_str","<ignored/>" ).name == "a" )
+assert( xml.unshare( "shared_str" ) and not xml.unshare( "shared_str" ) )
+assert( xml.unshare( "test.xml" ) and shared_doc.name == "root" )
+
+-- reload a file into a decoded table in place
+local function write_file( path,str )
+    local file = io.open( path,"w" )
+    file:write( str )
+    file:close()
+end
+write_file( "reload.xml",'<cfg><item id="1">a</item><item id="2">b</item></cfg>' )
+local reload_tb = xml.decode_from_file( "reload.xml" )
+local reload_item = reload_tb.value[2]
+write_file( "reload.xml",'<cfg><item id="1">a</item><item id="3">b</item><new/></cfg>' )
+local reload_changes = xml.reload( reload_tb,"reload.xml" )
+assert( #reload_changes == 2 and reload_tb.value[2] == reload_item )
+assert( reload_changes[1].path == "cfg/item[2]" and reload_changes[1].key == "id" )
+assert( reload_item.attribute.id == "3" and reload_tb.value[3].name == "new" )
+assert( #xml.reload( reload_tb,"reload.xml" ) == 0 )
+os.remove( "reload.xml" )
+
+-- inotify watcher(linux only),a burst of writes is reported once
+if xml.watcher then
+    write_file( "watch.xml","<a/>" )
+    local xml_watcher = xml.watcher()
+    assert( xml_watcher:add( "watch.xml" ) and #xml_watcher:poll() == 0 )
+    write_file( "watch.xml","<a v='1'/>" )
+    write_file( "watch.xml","<a v='2'/>" )
+    local watch_changed = xml_watcher:poll()
+    assert( #watch_changed == 1 and watch_changed[1] == "watch.xml" )
+    xml_watcher:close()
+    os.remove( "watch.xml" )
+end
+
+-- compact mode,attributes and leaf children are fields,repeated are arrays
+local compact_src = '<cfg ver="2"><item id="1"><hp>10</hp><buff>1</buff><buff>2</buff></item></cfg>'
+local compact_tb,compact_name = xml.decode( compact_src,{ compact = true } )
+assert( compact_name == "cfg" and compact_tb.ver == "2" )
+assert( compact_tb.item.hp == "10" and compact_tb.item.buff[2] == "2" )
+local compact_opts = { compact = true,attr_prefix = "@",arrays = { item = true } }
+compact_tb = xml.decode( compact_src,compact_opts )
+assert( compact_tb["@ver"] == "2" and compact_tb.item[1]["@id"] == "1" )
+-- fields are written in order of key,attributes only with a prefix
+local compact_xml = xml.encode_compact( compact_tb,"cfg",compact_opts )
+assert( compact_xml == '<?xml version="1.0" encoding="utf-8" ?><cfg ver="2">' ..
+    '<item id="1"><buff>1</buff><buff>2</buff><hp>10</hp></item></cfg>' )
+assert( same( xml.decode( compact_xml,compact_opts ),compact_tb ) )
+-- with the default options every scalar is a child element
+local item_tb = xml.decode( '<item id="1"><hp>10</hp></item>',{ compact = true } )
+local item_xml = xml.encode_compact( item_tb,"item" )
+assert( item_xml == '<?xml version="1.0" encoding="utf-8" ?><item><hp>10</hp><id>1</id></item>' )
+assert( same( xml.decode( item_xml,{ compact = true } ),item_tb ) )
+
+-- columnar decode,one array per field and numbers inferred
+local columns,column_rows = xml.decode_columns(
+    '<rows><row id="1" name="a"/><row id="2"><name>b</name></row><row name="007"/></rows>',
+    "rows/row",{ "id","name" },{ types = { name = "string" } } )
+assert( column_rows == 3 and columns.id[2] == 2 and columns.id[3] == false )
+assert( columns.name[2] == "b" and columns.name[3] == "007" )
+
+-- decode into a table decoded before,nested tables are reused
+local into_tb = xml.decode( '<msg id="1"><pos x="1"/><i>a</i><i>b</i></msg>' )
+local into_pos = into_tb.value[1]
+assert( xml.decode( '<msg id="2"><pos x="3"/><i>c</i></msg>',{ into = into_tb } ) == into_tb )
+assert( into_tb.value[1] == into_pos and into_pos.attribute.x == "3" )
+assert( #into_tb.value == 2 and into_tb.value[2].value == "c" and into_tb.attribute.id == "2" )
+
+-- large values as slices of the source string
+local slice_blob = string.rep( "z",64 )
+local slice_tb = xml.decode( "<m><s>x</s><b><![CDATA[" .. slice_blob .. "]]></b></m>",{ slice = 32 } )
+local slice = slice_tb.value[2].value
+assert( type( slice_tb.value[1].value ) == "string" and type( slice ) == "userdata" )
+assert( slice:len() == 64 and tostring( slice ) == slice_blob and slice:sub( -2 ) == "zz" )
+assert( xml.encode( slice_tb ) == xml.encode( { name = "m",value = {
+    { name = "s",value = "x" },{ name = "b",value = slice_blob } } } ) )
+local slice_src = "<m><b>" .. slice_blob .. "</b><c>" .. slice_blob .. "</c></m>"
+assert( not pcall( xml.decode,slice_src,{ slice = -1 } ) )
+assert( not pcall( xml.decode,slice_src,{ slice = 1.5 } ) )
+assert( not pcall( xml.decode,slice_src,{ slice = 32,into = {} } ) )
+assert( not pcall( xml.decode,slice_src,{ slice = 32,yield_nodes = 8 } ) )
+assert( not pcall( xml.decode,slice_src,{ slice = 32,compact = true } ) )
+assert( not pcall( xml.decode,slice_src,{ slice = 32,cache = true } ) )
+
+-- a finalized slice is rejected,it's siblings keep the source alive
+local gc_tb = xml.decode( slice_src,{ slice = 32 } )
+local gc_a,gc_b = gc_tb.value[1].value,gc_tb.value[2].value
+local slice_sub,slice_fn = gc_a.sub,getmetatable( gc_a ).__gc
+slice_fn( gc_a )
+slice_fn( gc_a )
+collectgarbage()
+assert( gc_b:sub( 1,5 ) == "zzzzz" and not pcall( slice_sub,gc_a,1,5 ) )